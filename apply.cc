@@ -1,51 +1,91 @@
 #include "apply.h"
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-/* This is in lieu of fgetln, which apparently isn't portable.  */
-char *line_buffer = NULL;
-int line_buffer_size = 256;
+/* Tokenise according to the modifier types from the lexer (although
+   using an algorithm that's somewhat more simplistic, and that won't
+   necessarily match up for odd input).
+   Also append the initial and final "#".  The commonest word by far is
+   one with no modifiers and nothing but ASCII in it, where every byte is
+   a phone of its own; plain() spots those, sixteen bytes at a time for
+   the top bits, and their phones come straight out of byte_phone.
+   Anything else is cut into units (see phones.h) going forwards, and
+   then made into phones going backwards over the units, so a phone only
+   ever grows at its front, and is just where it starts (it ends where
+   the one after it starts).  Each phone is looked up in place once it's
+   complete.
+   Given unknown, a word with a phone that's never been seen isn't
+   tokenised (since that would make the phone) but just gets *unknown
+   set.  */
+static bool plain(const char *s, int n) {
+  int i = 0, high = 0, mod = 0;
+#ifdef __SSE2__
+  for(; i+16<=n; i+=16)
+    high |= _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+#endif
+  for(; i<n; i++)
+    high |= s[i] & 0x80;
+  if (high)
+    return false;
+  for(i=0; i<n; i++)
+    mod |= modtype[(unsigned char)s[i]];
+  return !mod;
+}
 
-char *read_arbitrary_length_line(FILE *stream, size_t *p_len) {
-  if (!line_buffer) {
-    line_buffer = (char *)malloc(line_buffer_size * sizeof(char));
-  }
-  
-  line_buffer[0] = '\0';
-  
-  while (1) {
-    line_buffer[line_buffer_size-1] = -1;
-    if(NULL == fgets(line_buffer + strlen(line_buffer), line_buffer_size - strlen(line_buffer), stream)) {
-      return NULL;
-    }
-    if(line_buffer[line_buffer_size-1] == '\0' && line_buffer[line_buffer_size-2] != '\n') {
-      char *d = line_buffer;
-      line_buffer_size *= 2;
-      line_buffer = (char *)malloc(line_buffer_size * sizeof(char));
-      strcpy(line_buffer, d);
-      free(d);
+/* One more than the id of each byte's phone, or 0 if it's not been looked
+   up yet.  Under -S several requests tokenise at once; they can only ever
+   store the same id, but the entries are atomic so that's all above
+   board.  */
+static atomic<int> byte_phone[128];
+
+vector<int> *tokenise(const char *s, int n, bool *unknown) {
+  vector<int> *y = new vector<int>(0);
+  if (plain(s, n)) {
+    y->resize(n + 2);
+    (*y)[0] = (*y)[n+1] = BOUND_PH;
+    for(int i=0; i<n; i++) {
+      atomic<int> &b = byte_phone[(unsigned char)s[i]];
+      int p = b.load(memory_order_relaxed);
+      if (p == 0) {
+        p = 1 + find_phone(s + i, 1, !unknown);
+        b.store(p, memory_order_relaxed);
+      }
+      if (p == 0) {
+        *unknown = true;
+        delete y;
+        return NULL;
+      }
+      (*y)[i+1] = p - 1;
     }
-    else
-      break;
+    return y;
   }
 
-  *p_len = strlen(line_buffer);
-  return line_buffer;
-}
+  /* The units' starts and types, and the starts of the phones so far
+     (as unit numbers), last phone first.  */
+  static thread_local vector<int> u, t, b;
+  u.clear();
+  t.clear();
+  b.clear();
+  for(int i=0, k; i<n; i+=k) {
+    k = unit_length(s + i, n - i);
+    u.push_back(i);
+    t.push_back(unit_modtype(s + i, k));
+  }
+  u.push_back(n);
 
-/* Tokenise according to the modifier character types from the lexer
-   (although using an algorithm that's somewhat more simplistic, and
-   that won't necessarily match up for odd input).
-   Also append the initial and final "#".  */
-vector<string> *tokenise(string s) {
-  vector<string> *x = new vector<string>(0);
   bool append_next = false;
   int gather = 0;
-  for(int i=s.size()-1; i>=0; i--) {
+  for(int i=(int)t.size()-1; i>=0; i--) {
     if (append_next)
-      x->back() = s[i] + x->back();
+      b.back() = i;
     else
-      x->push_back(string(1, s[i]));
-    switch (modtype[s[i]]) {
+      b.push_back(i);
+    switch (t[i]) {
       case MOD01:
         append_next = false; gather = 1; break;
       case MOD10:
@@ -57,132 +97,568 @@ vector<string> *tokenise(string s) {
       default: /* catches CPHONE */
         append_next = false; gather = 0; break;
     }
-    if (x->size() <= gather)
+    if (b.size() <= gather) {
+      delete y;
       return NULL;
-    for(int k=gather-1; k>=0; k--) {
-      string t = x->back();
-      x->pop_back();
-      x->back() = t + x->back();
     }
+    b.resize(b.size() - gather);
+    b.back() = i;
   }
-  if (append_next)
+  if (append_next) {
+    delete y;
     return NULL;
+  }
 
-  x->push_back("#");
-  reverse(x->begin(), x->end());
-  x->push_back("#");
-  return x;
+  y->reserve(b.size() + 2);
+  y->push_back(BOUND_PH);
+  for(int k=b.size()-1; k>=0; k--) {
+    int from = u[b[k]], to = k ? u[b[k-1]] : n;
+    y->push_back(find_phone(s + from, to - from, !unknown));
+    if (y->back() < 0) {
+      *unknown = true;
+      delete y;
+      return NULL;
+    }
+  }
+  y->push_back(BOUND_PH);
+  return y;
 }
 
-void apply_changes() {
-  char *p;
-  size_t p_len;
-  
-  while (p = read_arbitrary_length_line(stdin, &p_len)) {
-    set<vector<string> > s0, s1, *s_old = &s0, *s_new = &s1, *s_tmp;
-    vector<string> *x; 
-
-    // strip off the final newline; if the line is then empty, don't do anything
-    p[p_len-1] = '\0';
-    for (; *p == ' ' || *p == '\t'; p++, p_len--);
-    if (first_word_only)
-      p = strsep(&p, " \t");
-    if(p[0] == '\0') 
-      continue;
-    
-    x = tokenise(string(p));
-    if (x == NULL) {
-      fprintf(stderr, "couldn't tokenise input word \"%s\"\n", p);
+/* Append the phones of a form to b, leaving off the bounding "#"s.  */
+void append_form(string &b, const vector<int> &v) {
+  for(int k=1; k<(int)v.size()-1; k++)
+    b += phone_name[v[k]];
+}
+
+/* Run form x through change i.  NULL if change i was built lazily and x
+   led it somewhere ambiguous.  */
+form_set *apply_change(int i, const vector<int> &x) {
+  vector<int> v = x;
+  transduce_stats st;
+  double t0 = profiles ? now() : 0;
+  form_set *s_tmp = changes[i]->transduce(&v, change_stuff[i]->max_epen, change_stuff[i]->reflect,
+                                          profiles ? &st : NULL);
+  if (s_tmp == NULL)
+    return NULL;
+  fix_bounds(s_tmp);
+  if (profiles)
+    profiles[i].add(now() - t0, 1, s_tmp->size(), s_tmp->size(), st);
+  return s_tmp;
+}
+
+/* Run form x back through change i, the other way to the rest (for -R and
+   -V).  */
+form_set *apply_opposite(int i, const vector<int> &x) {
+  vector<int> v = x;
+  change_parameters *p = change_stuff[i];
+  form_set *s_tmp = p->opposite->transduce(&v, p->max_epen, p->reflect, NULL);
+  fix_bounds(s_tmp);
+  return s_tmp;
+}
+
+/* Try to fix outcomes which aren't bounded by "#"s.  If we can't, remove them.
+     This bit of a hack is necessitated by the unfortunate choice of "#" as both
+     word boundaries, and I hope it doesn't cause problems elsewhere.  */
+void fix_bounds(form_set *s_tmp) {
+  if(!s_tmp->empty()) {
+    for(form_set::iterator jj=s_tmp->begin(), ii=jj++; ii!=s_tmp->end(); ii=jj++) {
+      if(ii->size() < 1 || (*ii)[0] != BOUND_PH || (*ii)[ii->size()-1] != BOUND_PH) {
+        vector<int> fix = *ii;
+        vector<int>::iterator kk = fix.begin();
+        s_tmp->erase(ii);
+        
+        for(; kk != fix.end() && *kk != BOUND_PH; ++kk);
+        if (kk == fix.end()) 
+          continue;
+        fix.erase(fix.begin(), kk);
+        kk = fix.begin();
+        for(++kk; kk != fix.end() && *kk != BOUND_PH; ++kk);
+        if (kk == fix.end()) 
+          continue;
+        fix.erase(++kk, fix.end());
+        s_tmp->insert(fix); // it may be reexamined, but that's no big deal
+      }
+      if(s_tmp->empty())
+        break;
+    }
+  }
+}
+
+/* Say what change i did to form x, if we've been asked to.  */
+void report_change(word_job *w, int i, const vector<int> &x, const form_set *s_tmp) {
+  if (debug_changes && (s_tmp->size() != 1 || *s_tmp->begin() != x)) {
+    w->out += change_stuff[i]->name;
+    w->out += reverse_changes ? " yields \"" : " applies to \"";
+    append_form(w->out, x);
+    w->out += reverse_changes ? "\" when applied to" : "\", yielding";
+    for(form_set::const_iterator ii=s_tmp->begin(); ii!=s_tmp->end(); ++ii) {
+      w->out += " \"";
+      append_form(w->out, *ii);
+      w->out += "\"";
+    }
+    w->out += "\n";
+  }
+
+  /* Complain if there's no words as output; this was hopefully due
+     to a constraint failure.  */
+  if (complaint && s_tmp->empty()) {
+    w->err += "warning: \"";
+    append_form(w->err, x);
+    w->err += "\" doesn't satisfy constraint " + change_stuff[i]->name + "\n";
+  }
+}
+
+/* Say that change i, built lazily, was found to be ambiguous on x.  A
+   change like that would have been refused without -L.  */
+void report_conflict(word_job *w, int i, const vector<int> &x) {
+  w->err += string(filename) + ": conflict in determinisation of " + change_stuff[i]->name +
+    " (sound change may have ambiguous cases), reached by \"";
+  append_form(w->err, x);
+  w->err += "\" from input word \"" + w->word + "\"\n";
+  w->failed = true;
+}
+
+/* With -R, allowed[i] holds every form that reverse change i could be
+   given and still have some way to end up as one of the proto-forms in
+   the file.  allowed[n] is the file's forms, and each allowed[i] is what
+   the forward version of change i makes of allowed[i+1]; they're kept
+   sorted for narrow().  */
+struct allowed_job {
+  int i;
+  const vector<vector<int> > *from;
+  vector<vector<int> > to;
+};
+
+static void apply_allowed_job(int k, void *jobs) {
+  vector<allowed_job> &v = *(vector<allowed_job> *)jobs;
+  allowed_job &j = v[k];
+  const vector<vector<int> > &from = *j.from;
+  for(size_t l=from.size()*k/v.size(); l<from.size()*(k+1)/v.size(); l++) {
+    form_set *s = apply_opposite(j.i, from[l]);
+    j.to.insert(j.to.end(), s->begin(), s->end());
+    delete s;
+  }
+}
+
+bool load_allowed() {
+  int fd = open(allowed_file, O_RDONLY);
+  if (fd < 0)
+    return false;
+  int n = changes.size();
+  allowed.assign(n+1, vector<vector<int> >());
+  {
+    word_reader in(fd);
+    const char *p;
+    size_t p_len;
+    while (in.next(&p, &p_len)) {
+      for (; p_len > 0 && (*p == ' ' || *p == '\t'); p++, p_len--);
+      size_t k = 0;
+      for (; k < p_len && p[k] != ' ' && p[k] != '\t'; k++);
+      if (k == 0)
+        continue;
+      vector<int> *x = tokenise(p, k);
+      if (x == NULL)
+        fprintf(stderr, "warning: couldn't tokenise allowed form \"%s\"\n", string(p, k).c_str());
+      else
+        allowed[n].push_back(*x);
+      delete x;
+    }
+  }
+  close(fd);
+
+  worker_pool pool(jobs);
+  for(int i=n; i>=0; i--) {
+    sort(allowed[i].begin(), allowed[i].end());
+    allowed[i].erase(unique(allowed[i].begin(), allowed[i].end()), allowed[i].end());
+    if (i == 0)
+      break;
+    vector<allowed_job> v(max(1, min(jobs, (int)allowed[i].size())));
+    for(int k=0; k<v.size(); k++) {
+      v[k].i = i-1;
+      v[k].from = &allowed[i];
+    }
+    pool.run(v.size(), apply_allowed_job, &v);
+    for(int k=0; k<v.size(); k++)
+      allowed[i-1].insert(allowed[i-1].end(), v[k].to.begin(), v[k].to.end());
+  }
+  return true;
+}
+
+/* Cut down the forms s that w has after change i: with -R, to those that
+   could still become allowed proto-forms, and with -C, to the first so
+   many of them.  */
+void narrow(word_job *w, int i, form_set *s) {
+  if (!allowed.empty()) {
+    for(form_set::iterator ii=s->begin(); ii!=s->end(); ) {
+      if (binary_search(allowed[i+1].begin(), allowed[i+1].end(), *ii))
+        ++ii;
+      else
+        s->erase(ii++);
+    }
+  }
+
+  if (max_candidates && s->size() > max_candidates) {
+    char b[64];
+    snprintf(b, sizeof(b), "warning: kept only %d of %d forms of \"", max_candidates, (int)s->size());
+    w->err += b + w->word + "\" after " + change_stuff[i]->name + "\n";
+    form_set::iterator ii = s->begin();
+    advance(ii, max_candidates);
+    s->erase(ii, s->end());
+  }
+}
+
+/* Run one word through all the changes.  Everything that would be printed
+   goes into w->out and w->err instead, so that this can be done for many
+   words at once and the results still come out in order.  Nothing here
+   may modify anything shared: in particular no phones get interned.
+   (The memo is shared, but it looks after itself.)  */
+void apply_word(word_job *w) {
+  form_set s0, s1, *s_old = &s0, *s_new = &s1, *s_tmp;
+
+  if (w->x == NULL) {
+    w->err += "couldn't tokenise input word \"" + w->word + "\"\n";
+    return;
+  }
+  s_old->insert(*w->x);
+
+  /* While w has only one form and the changes are sequential, the form
+     is kept in one and rewritten into other, with no sets involved.  Not
+     with -V or -R, which need to look at the sets.  */
+  vector<int> one, other;
+  bool single = false, lane = !round_trip && allowed.empty();
+
+  vector<form_set> stage; // for -V, what w was before each change
+  for(int i=0; i<changes.size(); i++) {
+    if (lane && changes[i]->sequential() && (single || s_old->size() == 1)) {
+      if (!single) {
+        one = *s_old->begin();
+        s_old->clear();
+        single = true;
+      }
+      double t0 = profiles ? now() : 0;
+      bool ok = changes[i]->transduce_sequential(one, other, change_stuff[i]->reflect);
+      if (profiles)
+        profiles[i].add(now() - t0, 1, ok, ok, transduce_stats());
+      if (ok && !debug_changes && other.size() >= 2 && other[0] == BOUND_PH && other.back() == BOUND_PH) {
+        one.swap(other);
+        continue;
+      }
+
+      /* Otherwise there's something to say or fix, as below.  */
+      if (ok)
+        s_old->insert(other);
+      fix_bounds(s_old);
+      report_change(w, i, one, s_old);
+      if (s_old->size() != 1)
+        single = false;
+      else {
+        one = *s_old->begin();
+        s_old->clear();
+      }
       continue;
     }
-    s_old->insert(*x);
-    delete x;
-
-    for(int i=0; i<changes.size(); i++) {
-      for(set<vector<string> >::iterator ii=s_old->begin(); ii!=s_old->end(); ++ii) {
-        vector<string> v = *ii;
-        s_tmp = changes[i]->transduce(&v, change_stuff[i]->max_epen, change_stuff[i]->reflect); 
-
-        /* Try to fix outcomes which aren't bounded by "#"s.  If we can't, remove them.
-           This bit of a hack is necessitated by the unfortunate choice of "#" as both
-           word boundaries, and I hope it doesn't cause problems elsewhere.  */
-        if(!s_tmp->empty()) {
-          for(set<vector<string> >::iterator jj=s_tmp->begin(), ii=jj++; ii!=s_tmp->end(); ii=jj++) {
-            if(ii->size() < 1 || (*ii)[0] != "#" || (*ii)[ii->size()-1] != "#") {
-              vector<string> fix = *ii;
-              vector<string>::iterator kk = fix.begin();
-              s_tmp->erase(ii);
-              
-              for(; kk != fix.end() && *kk != "#"; ++kk);
-              if (kk == fix.end()) 
-                continue;
-              fix.erase(fix.begin(), kk);
-              kk = fix.begin();
-              for(++kk; kk != fix.end() && *kk != "#"; ++kk);
-              if (kk == fix.end()) 
-                continue;
-              fix.erase(++kk, fix.end());
-              s_tmp->insert(fix); // it may be reexamined, but that's no big deal
-            }
-            if(s_tmp->empty())
-              break;
-          }
-        }
+    if (single) {
+      s_old->insert(one);
+      single = false;
+    }
 
-        if (debug_changes && (s_tmp->size() != 1 || *s_tmp->begin() != *ii)) {
-          if (reverse_changes)
-            printf("%s yields \"", change_stuff[i]->name.c_str());
-          else
-            printf("%s applies to \"", change_stuff[i]->name.c_str());            
-          for(int k=1; k<ii->size()-1; k++)
-            printf("%s", (*ii)[k].c_str());
-          if (reverse_changes)
-            printf("\" when applied to");  
-          else
-            printf("\", yielding");
-          for(set<vector<string> >::iterator ii=s_tmp->begin(); ii!=s_tmp->end(); ++ii) {
-            printf(" \"");
-            for(int k=1; k<ii->size()-1; k++)
-              printf("%s", (*ii)[k].c_str());
-            printf("\"");
-          }
-          printf("\n");
+    if (round_trip)
+      stage.push_back(*s_old);
+    for(form_set::iterator ii=s_old->begin(); ii!=s_old->end(); ++ii) {
+      s_tmp = memo ? memo->find(i, *ii) : NULL;
+      if (s_tmp == NULL) {
+        s_tmp = apply_change(i, *ii);
+        if (s_tmp == NULL) {
+          report_conflict(w, i, *ii);
+          return;
         }
+        if (memo)
+          memo->add(i, *ii, *s_tmp);
+      }
 
-        /* Complain if there's no words as output; this was hopefully due
-           to a constraint failure.  */
-        if (complaint && s_tmp->empty()) {
-          fprintf(stderr, "warning: \"");
-          for(int k=1; k<ii->size()-1; k++)
-            fprintf(stderr, "%s", (*ii)[k].c_str());
-          fprintf(stderr, "\" doesn't satisfy constraint %s\n", change_stuff[i]->name.c_str()); 
+      report_change(w, i, *ii, s_tmp);
+      s_new->insert(s_tmp->begin(), s_tmp->end());
+      delete s_tmp;
+    }
+
+    s_old->clear();
+    s_tmp = s_old; s_old = s_new; s_new = s_tmp;
+    narrow(w, i, s_old);
+  }
+  if (single)
+    s_old->insert(one);
+
+  if (round_trip) {
+    vector<char> back;
+    check_round_trip(w, stage, s_old, back);
+    finish_word(w, s_old, &back);
+  }
+  else
+    finish_word(w, s_old);
+}
+
+/* For -V: whether each of the forms s that w came out as leads back to it
+   through the changes the other way.  A way back can only go through what
+   w was before each change, stage[i], so each step back is cut down to
+   that as it goes, and is usually tiny.  The memo keeps the steps back
+   apart from the steps forward by numbering change i's other way n+i.  */
+void check_round_trip(word_job *w, const vector<form_set> &stage, const form_set *s, vector<char> &back) {
+  int n = changes.size();
+  for(form_set::const_iterator ii=s->begin(); ii!=s->end(); ++ii) {
+    form_set cur;
+    cur.insert(*ii);
+    for(int i=n-1; i>=0 && !cur.empty(); i--) {
+      form_set next;
+      for(form_set::iterator jj=cur.begin(); jj!=cur.end(); ++jj) {
+        form_set *s_tmp = memo ? memo->find(n+i, *jj) : NULL;
+        if (s_tmp == NULL) {
+          s_tmp = apply_opposite(i, *jj);
+          if (memo)
+            memo->add(n+i, *jj, *s_tmp);
         }
-        
-        s_new->insert(s_tmp->begin(), s_tmp->end());
+        for(form_set::iterator kk=s_tmp->begin(); kk!=s_tmp->end(); ++kk)
+          if (stage[i].count(*kk))
+            next.insert(*kk);
         delete s_tmp;
       }
+      cur.swap(next);
+    }
+    back.push_back(!cur.empty());
+  }
+}
 
-      s_old->clear();
-      s_tmp = s_old; s_old = s_new; s_new = s_tmp;
+/* Output all the possibilities s for w, one per line; or, with -O, one
+   record per possibility: the input word, which possibility it is, and
+   the form, each followed by a tab (a newline for the last) or a NUL.
+   With -V, back says which possibilities lead back to w: records get a
+   fourth field, 1 or 0, and otherwise we just say whether they all do.  */
+void finish_word(word_job *w, const form_set *s, const vector<char> *back) {
+  if (output_format != PLAIN_OUTPUT) {
+    char sep = output_format == TSV_OUTPUT ? '\t' : '\0';
+    char end = output_format == TSV_OUTPUT ? '\n' : '\0';
+    int k = 0;
+    for(form_set::const_iterator ii=s->begin(); ii!=s->end(); ++ii, ++k) {
+      char b[16];
+      snprintf(b, sizeof(b), "%d", k);
+      ((w->out += w->word) += sep) += b;
+      w->out += sep;
+      append_form(w->out, *ii);
+      if (back)
+        (w->out += sep) += (*back)[k] ? "1" : "0";
+      w->out += end;
     }
+    return;
+  }
 
-    /* Output all the possibilities, one per line.  */
-    if (display_wedges) {
-      if (reverse_changes)
-        printf("%s < ", p);
-      else
-        printf("%s > ", p);
+  if (back) {
+    w->out += w->word;
+    if (s->empty())
+      w->out += ": no forms";
+    else if (count(back->begin(), back->end(), 0) == 0)
+      w->out += ": ok";
+    else {
+      w->out += ": doesn't come back from";
+      int k = 0;
+      for(form_set::const_iterator ii=s->begin(); ii!=s->end(); ++ii, ++k)
+        if (!(*back)[k]) {
+          w->out += " ";
+          append_form(w->out, *ii);
+        }
+    }
+    w->out += "\n";
+    return;
+  }
+
+  if (display_wedges)
+    w->out += w->word + (reverse_changes ? " < " : " > ");
+  for(form_set::const_iterator ii=s->begin(); ii!=s->end(); ++ii) {
+    if (ii!=s->begin())
+      w->out += " ";
+    append_form(w->out, *ii);
+  }
+  if (display_brackets)
+    w->out += " [" + w->word + "]";
+  w->out += "\n";
+}
+
+static void apply_word_job(int i, void *batch) {
+  apply_word(&(*(vector<word_job> *)batch)[i]);
+}
+
+/* For -T: some of the different forms a batch of words has got to by
+   change i, and what that change makes of them.  */
+struct sorted_job {
+  int i;
+  vector<vector<int> > x;
+  vector<form_set *> r;
+};
+
+static void apply_sorted_job(int k, void *jobs) {
+  sorted_job &j = (*(vector<sorted_job> *)jobs)[k];
+  transduce_stats st;
+  double t0 = profiles ? now() : 0;
+  changes[j.i]->transduce_sorted(j.x, j.r, change_stuff[j.i]->max_epen, change_stuff[j.i]->reflect,
+                                 profiles ? &st : NULL);
+  unsigned long out = 0, most = 0;
+  for(int l=0; l<j.r.size(); l++) {
+    if (j.r[l] == NULL)
+      continue;
+    fix_bounds(j.r[l]);
+    out += j.r[l]->size();
+    most = max(most, (unsigned long)j.r[l]->size());
+  }
+  if (profiles)
+    profiles[j.i].add(now() - t0, j.x.size(), out, most, st);
+}
+
+/* Run a whole batch of words through the changes a change at a time.  At
+   each change we gather up the different forms the words have got to and
+   transduce them all together, so that forms which begin alike share the
+   work of reading their beginning (see transduce_sorted()).  The pool
+   gets them in sorted runs.  What's printed for each word comes out just
+   as apply_word() would have it.  */
+void apply_batch_sorted(vector<word_job> &batch, worker_pool &pool) {
+  vector<form_set> cur(batch.size());
+  for(int w=0; w<batch.size(); w++)
+    if (batch[w].x == NULL)
+      batch[w].err += "couldn't tokenise input word \"" + batch[w].word + "\"\n";
+    else
+      cur[w].insert(*batch[w].x);
+
+  for(int i=0; i<changes.size(); i++) {
+    map<vector<int>, form_set *> done;
+    vector<vector<int> > todo;
+    for(int w=0; w<batch.size(); w++)
+      for(form_set::iterator ii=cur[w].begin(); ii!=cur[w].end(); ++ii) {
+        pair<map<vector<int>, form_set *>::iterator, bool> jj =
+          done.insert(pair<vector<int>, form_set *>(*ii, NULL));
+        if (jj.second && (!memo || (jj.first->second = memo->find(i, *ii)) == NULL))
+          todo.push_back(*ii);
+      }
+    sort(todo.begin(), todo.end());
+
+    vector<sorted_job> jobs(min((size_t)pool.threads, todo.size()));
+    for(int k=0; k<jobs.size(); k++) {
+      jobs[k].i = i;
+      jobs[k].x.assign(todo.begin() + todo.size() * k / jobs.size(),
+                       todo.begin() + todo.size() * (k+1) / jobs.size());
     }
-    for(set<vector<string> >::iterator ii=s_old->begin(); ii!=s_old->end(); ++ii) {
-      if (ii!=s_old->begin())
-        printf(" ");
-      for(int k=1; k<ii->size()-1; k++)
-        printf("%s", (*ii)[k].c_str());
+    pool.run(jobs.size(), apply_sorted_job, &jobs);
+    for(int k=0; k<jobs.size(); k++)
+      for(int l=0; l<jobs[k].x.size(); l++) {
+        done[jobs[k].x[l]] = jobs[k].r[l];
+        if (memo && jobs[k].r[l])
+          memo->add(i, jobs[k].x[l], *jobs[k].r[l]);
+      }
+
+    for(int w=0; w<batch.size(); w++) {
+      form_set next;
+      for(form_set::iterator ii=cur[w].begin(); ii!=cur[w].end(); ++ii) {
+        form_set *s_tmp = done[*ii];
+        if (s_tmp == NULL) {
+          report_conflict(&batch[w], i, *ii);
+          next.clear();
+          break;
+        }
+        report_change(&batch[w], i, *ii, s_tmp);
+        next.insert(s_tmp->begin(), s_tmp->end());
+      }
+      cur[w].swap(next);
+      narrow(&batch[w], i, &cur[w]);
     }
-    if (display_brackets)
-      printf(" [%s]", p);
-    printf("\n");
+    for(map<vector<int>, form_set *>::iterator ii=done.begin(); ii!=done.end(); ++ii)
+      delete ii->second;
   }
+
+  for(int w=0; w<batch.size(); w++)
+    if (batch[w].x != NULL && !batch[w].failed)
+      finish_word(&batch[w], &cur[w]);
+}
+
+/* Read words from stdin, run them through the changes, and write the
+   results.  With more than one job we read words in batches, tokenise them
+   here (since tokenising may intern new phones), and let the pool at them;
+   the shared automata are only ever read from then on.  With -T the
+   batches are big regardless, since the more words there are the more
+   they have in common.  */
+void apply_changes() {
+  word_reader in(fileno(stdin));
+  fflush(stdout); // -D may have printed things
+  word_writer out(fileno(stdout));
+  const char *p;
+  size_t p_len;
+  worker_pool pool(jobs);
+  int batch_size = sorted_batches ? 4096 : jobs > 1 ? 256 * jobs : 1;
+  vector<word_job> batch;
+  bool more = true;
+  
+  while (more) {
+    batch.clear();
+    while (batch.size() < batch_size && in.next(&p, &p_len)) {
+      // if the line is empty once the blanks are off its front, don't do anything
+      for (; p_len > 0 && (*p == ' ' || *p == '\t'); p++, p_len--);
+      if (first_word_only) {
+        size_t k = 0;
+        for (; k < p_len && p[k] != ' ' && p[k] != '\t'; k++);
+        p_len = k;
+      }
+      if (p_len == 0)
+        continue;
+
+      batch.push_back(word_job());
+      batch.back().word.assign(p, p_len);
+      batch.back().x = tokenise(p, p_len);
+    }
+    if (batch.size() < batch_size)
+      more = false;
+
+    if (sorted_batches && !round_trip)
+      apply_batch_sorted(batch, pool);
+    else
+      pool.run(batch.size(), apply_word_job, &batch);
+
+    for(int i=0; i<batch.size(); i++) {
+      fputs(batch[i].err.c_str(), stderr);
+      out.add(batch[i].out);
+      delete batch[i].x;
+      if (batch[i].failed) {
+        out.flush();
+        exit(1);
+      }
+    }
+    if (out.tty)
+      out.flush();
+  }
+}
+
+
+/* For the server (-S): run words through the changes now in the globals,
+   and add to reply what would have been printed for them, with what would
+   have gone to stderr marked by "! " at the start of each line.  Unless
+   make_phones, a word with a phone never seen before makes us give up at
+   once, since making the phone would upset anyone else using the phones;
+   we say false then, having added nothing.  */
+bool answer_words(const vector<string> &words, bool make_phones, string &reply) {
+  vector<word_job> batch(words.size());
+  bool unknown = false;
+  for(int i=0; i<words.size() && !unknown; i++) {
+    batch[i].word = words[i];
+    batch[i].x = tokenise(words[i].data(), words[i].size(), make_phones ? NULL : &unknown);
+  }
+
+  for(int i=0; i<batch.size() && !unknown; i++) {
+    apply_word(&batch[i]);
+    for(size_t k=0, l; k<batch[i].err.size(); k=l+1) {
+      l = batch[i].err.find('\n', k);
+      reply += "! " + batch[i].err.substr(k, l - k) + "\n";
+      if (l == string::npos)
+        break;
+    }
+    reply += batch[i].out;
+  }
+  for(int i=0; i<batch.size(); i++)
+    delete batch[i].x;
+  return !unknown;
 }
 
 
@@ -221,19 +697,74 @@ bool handle_args(int argc, char **argv) {
       display_wedges = true;
     else if (!strcmp(argv[i], "-f")) // only convert the first word on each line
       first_word_only = true;
-    else {
-      if (filename != NULL)
+    else if (!strcmp(argv[i], "-O")) { // one output form per record, for other programs
+      if (i >= argc-1)
+        return true;
+      i++;
+      if (!strcmp(argv[i], "tsv"))
+        output_format = TSV_OUTPUT;
+      else if (!strcmp(argv[i], "nul"))
+        output_format = NUL_OUTPUT;
+      else
+        return true;
+    }
+    else if (!strcmp(argv[i], "-j")) { // number of threads to apply changes with
+      if (i >= argc-1 || (jobs = atoi(argv[++i])) < 1)
+        return true;
+    }
+    else if (!strcmp(argv[i], "-R")) { // only look for proto-forms listed in this file
+      if (i >= argc-1)
+        return true;
+      allowed_file = argv[++i];
+    }
+    else if (!strcmp(argv[i], "-V")) // check that outputs lead back to their words
+      round_trip = true;
+    else if (!strcmp(argv[i], "-C")) { // keep at most this many forms of a word
+      if (i >= argc-1 || (max_candidates = atoi(argv[++i])) < 1)
+        return true;
+    }
+    else if (!strcmp(argv[i], "-c")) // keep the compiled changes in a cache file
+      use_cache = true;
+    else if (!strcmp(argv[i], "-F")) // compose runs of changes into one automaton
+      fuse = true;
+    else if (!strcmp(argv[i], "-m")) { // remember results of changes, in this many megabytes
+      if (i >= argc-1 || (memo_megabytes = atoi(argv[++i])) < 1)
+        return true;
+    }
+    else if (!strcmp(argv[i], "-M")) // print how well remembering went
+      memo_stats = true;
+    else if (!strcmp(argv[i], "-T")) // share the work on words that begin alike
+      sorted_batches = true;
+    else if (!strcmp(argv[i], "-L")) // build the changes' automata as they're needed
+      lazy_changes = true;
+    else if (!strcmp(argv[i], "-S")) { // answer requests on this socket, or stdin for "-"
+      if (i >= argc-1)
         return true;
-      filename = strdup(argv[i]);
+      server_socket = argv[++i];
+    }
+    else if (!strcmp(argv[i], "-P")) // say what each change cost
+      profiling = true;
+    else if (!strcmp(argv[i], "-PJ")) // the same, as JSON
+      profiling = profile_json = true;
+    else {
+      rule_files.push_back(argv[i]);
+      if (filename == NULL)
+        filename = strdup(argv[i]);
     }
   }
 
-  return (filename == NULL);
+  /* The server chooses the direction per request, and has no use for
+     the things that are only worked out once per run.  */
+  if (server_socket)
+    return (filename == NULL || reverse_changes || allowed_file || round_trip || lazy_changes ||
+            debug_automata || profiling || output_format == NUL_OUTPUT);
+  return (filename == NULL || rule_files.size() > 1 || (allowed_file && !reverse_changes));
 }
 
 int main(int argc, char **argv) {
   if (handle_args(argc, argv)) {
     fprintf(stderr, "usage: %s [options] <sound change file>\n", argv[0]);
+    fprintf(stderr, "       %s -S <socket> [options] <sound change files>\n", argv[0]);
     fprintf(stderr, "allowed options are\n");
     fprintf(stderr, "-r          apply sound changes in reverse\n");
     fprintf(stderr, "-d          print intermediate sound change results\n");
@@ -244,17 +775,91 @@ int main(int argc, char **argv) {
     fprintf(stderr, "-b          repeat the input word in brackets []\n");
     fprintf(stderr, "-B          repeat the input word with a wedge < >\n");
     fprintf(stderr, "-f          only process the first word on each line\n");
+    fprintf(stderr, "-O <fmt>    write each output form as input word, number and form,\n");
+    fprintf(stderr, "            separated by tabs (fmt \"tsv\") or ended by NULs (\"nul\")\n");
+    fprintf(stderr, "-j <n>      build and apply changes with n threads\n");
+    fprintf(stderr, "-R <file>   with -r, only find the proto-forms listed in file, one per line\n");
+    fprintf(stderr, "-V          say whether each output leads back to its word the other way\n");
+    fprintf(stderr, "-C <n>      keep at most n forms of each word after each sound change\n");
+    fprintf(stderr, "-c          cache the compiled sound changes next to the file\n");
+    fprintf(stderr, "-F          fuse runs of sound changes into single transducers\n");
+    fprintf(stderr, "-m <n>      remember results of sound changes in up to n MB (kept with -c)\n");
+    fprintf(stderr, "-M          print statistics about the remembered results\n");
+    fprintf(stderr, "-T          share work between words with the same beginning\n");
+    fprintf(stderr, "-L          build each sound change's transducer only as far as it's used\n");
+    fprintf(stderr, "-P          print the time and work each sound change took (-PJ: as JSON)\n");
+    fprintf(stderr, "-S <path>   keep the files compiled and answer requests on a Unix socket at\n");
+    fprintf(stderr, "            path (or on stdin, for \"-\"), each a line \"<file> > words\"\n");
+    fprintf(stderr, "            or \"<file> < words\"; not with -r, -R, -V, -L, -D, -P or -O nul\n");
     exit(1);
   }
 
-  if (NULL == (yyin = fopen(filename, "r"))) {
-    fprintf(stderr, "couldn't open \"%s\"\n", filename);
-    exit(1);
+  if (server_socket) {
+    if (output_format == PLAIN_OUTPUT)
+      display_wedges = true;
+    serve(server_socket);
+    return 0;
+  }
+
+  /* With -c, try the cache first; if it's missing or stale, parse as
+     usual and write a new one.  There's no point when the automata are
+     to be printed, since that happens during parsing, nor when they're
+     to be built lazily, since they're never finished, nor with -R or -V,
+     which need the changes both ways.  */
+  bool cached = false, hashed = false;
+  uint64_t key = 0;
+  string cfile = cache_name(filename, reverse_changes);
+  if (use_cache && !debug_automata && !lazy_changes && !allowed_file && !round_trip) {
+    key = hash_file(filename, &hashed);
+    cached = hashed && load_cache(cfile.c_str(), key, reverse_changes);
   }
+
+  if (!cached) {
+    if (NULL == (yyin = fopen(filename, "r"))) {
+      fprintf(stderr, "couldn't open \"%s\"\n", filename);
+      exit(1);
+    }
   
-  yyparse();
+    if (yyparse() == 0 && hashed && !save_cache(cfile.c_str(), key, reverse_changes))
+      fprintf(stderr, "warning: couldn't write cache file \"%s\"\n", cfile.c_str());
+  }
+
+  /* Fusing hides the intermediate results that -d shows, and those
+     that -R and -V look at.  */
+  int fusing = 0;
+  if (fuse && !debug_changes && !allowed_file && !round_trip) {
+    fuse_changes(complaint);
+    fusing = 1 + complaint; // since that changes what gets fused
+  }
+
+  if (allowed_file && !load_allowed()) {
+    fprintf(stderr, "couldn't open \"%s\"\n", allowed_file);
+    exit(1);
+  }
+
+  /* The memo goes next to the cache, and is only good for the same
+     changes fused the same way.  */
+  string mfile = cache_name(filename, reverse_changes, "memo");
+  if (memo_megabytes) {
+    memo = new memo_table((size_t)memo_megabytes << 20);
+    if (hashed)
+      memo->load(mfile.c_str(), key, fusing);
+  }
+
+  if (profiling)
+    profiles = new change_profile[changes.size()];
 
   apply_changes();
+
+  if (profiles)
+    report_profile(stderr, profiles, profile_json);
+
+  if (memo) {
+    if (hashed && !memo->save(mfile.c_str(), key, fusing))
+      fprintf(stderr, "warning: couldn't write memo file \"%s\"\n", mfile.c_str());
+    if (memo_stats)
+      memo->stats(stderr);
+  }
   
   return 0;
 }
@@ -5,16 +5,45 @@
 
 #include "automaton.h"
 #include "soundchange.h"
+#include "pool.h"
+#include "cache.h"
+#include "fuse.h"
+#include "memo.h"
+#include "profile.h"
+#include "reader.h"
+#include "writer.h"
+#include "server.h"
 #include "soundchange.tab.h"
 
 extern FILE *yyin;
 extern int yyparse();
-extern int modtype[256];
 extern vector<automaton *> changes;
 extern vector<change_parameters *> change_stuff;
 
-vector<string> *tokenise(string s);
+/* One input word's worth of work for apply_word().  */
+struct word_job {
+  string word; // the input as given
+  vector<int> *x; // its tokenisation, or NULL if that failed
+  string out, err; // what it printed to stdout and stderr
+  bool failed; // a lazily built change turned out to be ambiguous
+
+  word_job() : x(NULL), failed(false) {}
+};
+
+vector<int> *tokenise(const char *s, int n, bool *unknown = NULL);
+form_set *apply_change(int i, const vector<int> &x);
+form_set *apply_opposite(int i, const vector<int> &x);
+void fix_bounds(form_set *s_tmp);
+void report_change(word_job *w, int i, const vector<int> &x, const form_set *s_tmp);
+void report_conflict(word_job *w, int i, const vector<int> &x);
+bool load_allowed();
+void narrow(word_job *w, int i, form_set *s);
+void apply_word(word_job *w);
+void check_round_trip(word_job *w, const vector<form_set> &stage, const form_set *s, vector<char> &back);
+void finish_word(word_job *w, const form_set *s, const vector<char> *back = NULL);
+void apply_batch_sorted(vector<word_job> &batch, worker_pool &pool);
 void apply_changes();
+bool answer_words(const vector<string> &words, bool make_phones, string &reply);
 bool handle_args(int argv, char **argc);
 int main(int argv, char **argc);
 
@@ -26,5 +55,24 @@ bool complaint = true;
 bool display_brackets = false;
 bool display_wedges = false;
 bool first_word_only = false;
+enum {PLAIN_OUTPUT, TSV_OUTPUT, NUL_OUTPUT};
+int output_format = PLAIN_OUTPUT;
+int jobs = 1;
+bool use_cache = false;
+bool fuse = false;
+int memo_megabytes = 0;
+bool memo_stats = false;
+memo_table *memo = NULL;
+bool sorted_batches = false;
+bool lazy_changes = false;
+char *allowed_file = NULL;
+vector<vector<vector<int> > > allowed; // for -R; see load_allowed()
+int max_candidates = 0; // for -C, if not 0
+bool round_trip = false;
+char *server_socket = NULL; // for -S
+vector<char *> rule_files; // more than one only with -S
+bool profiling = false;
+bool profile_json = false;
+change_profile *profiles = NULL; // one per change, if profiling
 
 #endif
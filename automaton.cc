@@ -4,6 +4,7 @@
 automaton::automaton(int n) {
   q = vector<automaton_state>(n);
   q0 = q1 = 0;
+  lazy = NULL;
 }
 
 /* Construct an automaton to contain a given transition. */
@@ -11,6 +12,7 @@ automaton::automaton(transition *t) {
   q = vector<automaton_state>(2);
   q0 = 0;
   q1 = 1;
+  lazy = NULL;
 
   t->d = q1;
   q[q0].t.push_back(t);
@@ -21,16 +23,15 @@ automaton::automaton(char *x, char *y) {
   q = vector<automaton_state>(2);
   q0 = 0;
   q1 = 1;
+  lazy = NULL;
 
   if (y == NULL) {
-    string sx(x);
-    cst_transition *t = new cst_transition(sx);
+    cst_transition *t = new cst_transition(intern(x));
     t->d = q1;
     q[q0].t.push_back(t);
   }
   else {
-    string sx(x), sy(y);
-    pos_transition *t = new pos_transition(sx, sy);
+    pos_transition *t = new pos_transition(intern(x), intern(y));
     t->d = q1;
     q[q0].t.push_back(t);
   }
@@ -40,10 +41,11 @@ automaton::automaton(char *x, char *y) {
    is whether to transition on just these phones (true) or
    all but them (false).  The third is a group number to
    let the transition define.  */
-automaton::automaton(vector<string> *cat, bool p, int group) {
+automaton::automaton(vector<int> *cat, bool p, int group) {
   q = vector<automaton_state>(2);
   q0 = 0;
   q1 = 1;
+  lazy = NULL;
 
   if (p) {
     cst_transition *t = new cst_transition(*cat);
@@ -60,10 +62,11 @@ automaton::automaton(vector<string> *cat, bool p, int group) {
 }
 
 /* Construct an automaton for two corresponding lists of phones.  */
-automaton::automaton(vector<string> *cat0, vector<string> *cat1) {
+automaton::automaton(vector<int> *cat0, vector<int> *cat1) {
   q = vector<automaton_state>(2);
   q0 = 0;
   q1 = 1;
+  lazy = NULL;
 
   pos_transition *t = new pos_transition(*cat0, *cat1);
   t->d = q1;
@@ -165,7 +168,7 @@ void automaton::catenate(automaton *a) {
 /* Become the Kleene closure (this*).  */
 void automaton::kleene_star() {
   unify_states(q0, q1);
-  cst_transition *u = new cst_transition("0");
+  cst_transition *u = new cst_transition(ZERO_PH);
   u->d = q.size();
   q[q1].t.push_back(u);
   q1 = q.size();
@@ -176,9 +179,9 @@ void automaton::kleene_star() {
 void automaton::alternate(automaton *a) {
   merge(a);
   unify_states(q1, mq1);
-  cst_transition *t = new cst_transition("0");
+  cst_transition *t = new cst_transition(ZERO_PH);
   t->d = q0;
-  cst_transition *u = new cst_transition("0");
+  cst_transition *u = new cst_transition(ZERO_PH);
   u->d = mq0;
   q0 = q.size();
   q.resize(q0 + 1);
@@ -189,17 +192,17 @@ void automaton::alternate(automaton *a) {
 /* Become the optionalization (this?).   Note that in this and
    the next function 0 represents the empty string.  */
 void automaton::optionalize() {
-  cst_transition *t = new cst_transition("0");
+  cst_transition *t = new cst_transition(ZERO_PH);
   t->d = q1;
   q[q0].t.push_back(t);
 }
 
 /* Become the nonempty Kleene closure (this+).  */
 void automaton::kleene_plus() {
-  cst_transition *t = new cst_transition("0");
+  cst_transition *t = new cst_transition(ZERO_PH);
   t->d = q0;
   q[q1].t.push_back(t);
-  cst_transition *u = new cst_transition("0");
+  cst_transition *u = new cst_transition(ZERO_PH);
   u->d = q.size();
   q[q1].t.push_back(u);
   q1 = q.size();
@@ -290,63 +293,118 @@ void automaton::display() {
    There's an analogous catch even in dealing with states of
    form 1, so give these form 4; but there's another catch, in
    that we also need to record where these states actually go.
-   For this we have the argument catch_form1; if it's true, we
-   use form 4, else not.  */
-void automaton::zero_close(set<pair<int, vector<string> > > *s, int k, vector<string> &output,
-                           bool catch_form1, int n) {
-  /* Look for evidence that we've already dealt with this state.
-     I've actually got no idea how sound this is.  */
-  for(set<pair<int, vector<string> > >::iterator ii=s->begin(); ii!=s->end(); ++ii)
-    if (ii->first == k)
-      return;
-  if (n == -1) // compute the size if it wasn't given
-    n = q.size();
-  s->insert(pair<int, vector<string> >(k, vector<string>(output)));
-
-  int ka = k%n, kk = k/n;
-  for(int j=q[ka].t.size()-1; j>=0; j--) {
-    if(q[ka].t[j]->trigger_set().contains("0")) {
-      if(q[ka].t[j]->kind() == CST_TR)
-        zero_close(s, q[ka].t[j]->d + kk*n, output, n);
-      else if(q[ka].t[j]->kind() == POS_TR) {
-        if (kk != 0 && !(kk == 1 && catch_form1)) {
-          vector<string> u = q[ka].t[j]->all_outcomes("0");
-          vector<string> output0(output);
-          for(int l=u.size()-1; l>=0; l--) {
-            if(u[l] != "0" && kk == 1) 
-              output0.push_back(u[l]); 
-            zero_close(s, q[ka].t[j]->d + kk*n, output0, n);
-          }
-        }
-        else if (kk == 1) {
-          /* These also deserve special treatment, just as the form 0s do.
-             But there's a catch!  */
-          s->insert(pair<int, vector<string> >(ka + 4*n, vector<string>(0)));
-        }
-        else {
-          /* This is the first encounter of a rewriting transition in form 0, so
-             the output had better be empty. */
-          s->insert(pair<int, vector<string> >(ka + 3*n, vector<string>(0)));
+   For this we have the argument catch_form1; if it's false, the
+   rewriting transitions out of k itself are followed rather than
+   given form 4 (but those further on still are).
+
+   A state keeps the output of the first path found to it, so this
+   has to find them in the order a depth-first search would.  It
+   does so with a stack of its own rather than by recursing, and
+   seen[] (holding stamp for the states this closure has visited)
+   saves searching s for them.  The closure never leaves k's form.  */
+void automaton::zero_close(reach_set *s, int k, bool catch_form1, const vector<vector<zero_edge> > &zeros,
+                           vector<int> &seen, int stamp, int n) {
+  int kk = k/n;
+  vector<pair<int, vector<int> > > stack(1, pair<int, vector<int> >(k, vector<int>(0)));
+  vector<pair<int, vector<int> > > next;
+  bool top = true;
+
+  while (!stack.empty()) {
+    pair<int, vector<int> > v;
+    v.swap(stack.back());
+    stack.pop_back();
+    if (seen[v.first] == stamp)
+      continue;
+    seen[v.first] = stamp;
+    s->insert(v);
+
+    int ka = v.first%n;
+    next.clear();
+    for(int j=0; j<zeros[ka].size(); j++) {
+      const zero_edge &e = zeros[ka][j];
+      if (!e.pos)
+        next.push_back(pair<int, vector<int> >(e.d + kk*n, v.second));
+      else if (kk != 0 && !(kk == 1 && (catch_form1 || !top))) {
+        vector<int> output0(v.second);
+        for(int l=e.out.size()-1; l>=0; l--) {
+          if(e.out[l] != ZERO_PH && kk == 1)
+            output0.push_back(e.out[l]);
+          next.push_back(pair<int, vector<int> >(e.d + kk*n, output0));
         }
       }
+      else if (kk == 1) {
+        /* These also deserve special treatment, just as the form 0s do.
+           But there's a catch!  */
+        s->insert(pair<int, vector<int> >(ka + 4*n, vector<int>(0)));
+      }
+      else {
+        /* This is the first encounter of a rewriting transition in form 0, so
+           the output had better be empty. */
+        s->insert(pair<int, vector<int> >(ka + 3*n, vector<int>(0)));
+      }
+    }
+    top = false;
+
+    /* The first of these has to be popped first.  */
+    for(int l=next.size()-1; l>=0; l--) {
+      stack.push_back(pair<int, vector<int> >());
+      stack.back().first = next[l].first;
+      stack.back().second.swap(next[l].second);
+    }
+  }
+}
+
+static size_t hash_set(const vector<int> &v) {
+  uint64_t h = v.size();
+  for(int i=0; i<v.size(); i++)
+    h = mix(h ^ (unsigned)v[i]);
+  return h;
+}
+
+/* The index of v, adding it (as having become state m) if it's new.  */
+int state_sets::intern(const vector<int> &v, int m, bool *added) {
+  if (2 * (sets.size() + 1) > slot.size())
+    grow();
+  size_t k = slot.size() - 1;
+  *added = false;
+  for(size_t i=hash_set(v) & k; ; i=(i+1) & k) {
+    if (slot[i] == -1) {
+      slot[i] = sets.size();
+      sets.push_back(v);
+      state.push_back(m);
+      *added = true;
+      return slot[i];
     }
+    if (sets[slot[i]] == v)
+      return slot[i];
+  }
+}
+
+void state_sets::grow() {
+  slot.assign(2 * slot.size(), -1);
+  size_t k = slot.size() - 1;
+  for(int j=0; j<sets.size(); j++) {
+    size_t i = hash_set(sets[j]) & k;
+    for(; slot[i] != -1; i=(i+1) & k);
+    slot[i] = j;
   }
 }
 
 /* Given a set of states from the determinization construction, return
    a state number for it.  If we've already made it, simply look up
    and return its state number.  If not, make it and do the appropriate thing.  */
-int automaton::get_or_create_determination(set<int> &t0, map<set<int>, int> &label,
-                                           int &m, deque<set<int> > &queue, int n) {
-  if(label.find(t0) == label.end()) {
+int automaton::get_or_create_determination(const set<int> &t0, state_sets &label,
+                                           int &m, deque<int> &queue, int n) {
+  bool added;
+  int k = label.intern(vector<int>(t0.begin(), t0.end()), m, &added);
+  if(added) {
     /* We've encountered a new state.  */
-    label[t0] = m;
-    queue.push_back(t0);
+    queue.push_back(k);
 
     q.resize(m+1);
     /* Statesets with a state of form 1 are not accepting. */
     q[m].accept = true;
-    for(set<int>::iterator kk=t0.begin(); kk!=t0.end(); ++kk)
+    for(set<int>::const_iterator kk=t0.begin(); kk!=t0.end(); ++kk)
       if(*kk/n == 1) {
         q[m].accept = false;
         break;
@@ -354,7 +412,7 @@ int automaton::get_or_create_determination(set<int> &t0, map<set<int>, int> &lab
 
     m++;
   }
-  return label[t0];
+  return label.state[k];
 }
 
 /* Given a zero closure-style set of states and strings, return a state that
@@ -364,16 +422,16 @@ int automaton::get_or_create_determination(set<int> &t0, map<set<int>, int> &lab
    a new state (and not remember it, so we'll reconstruct it if it comes to that)
    which serves.   The reason for the exception is to keep the number of states down
    (not especially to minimize computation time, which is a bit of a lost cause).  */
-int automaton::zero_reach(set<pair<int,vector<string> > > &g,
-                          vector<set<pair<int,vector<string> > > > &zero_closure, bool not_sporadic,
-                          map<set<int>, int> &label,
-                          int &m, deque<set<int> > &queue, int aq1, int n) {
+int automaton::zero_reach(reach_set &g, vector<reach_set> &zero_closure,
+                          vector<reach_set> &zero_closure_breaking, bool not_sporadic,
+                          state_sets &label,
+                          int &m, deque<int> &queue, int aq1, int n) {
   /* Test for the no nonempty and decent case. */
-  set<pair<int,vector<string> > >::iterator ii;
+  reach_set::iterator ii;
   set<int> t0;
   for(ii = g.begin(); ii != g.end(); ++ii) {
     t0.insert(ii->first);
-    if(ii->second != vector<string>(0) || ii->first/n == 3 || ii->first/n == 4)
+    if(ii->second != vector<int>(0) || ii->first/n == 3 || ii->first/n == 4)
       break;
   }
   if (ii == g.end())
@@ -381,7 +439,7 @@ int automaton::zero_reach(set<pair<int,vector<string> > > &g,
 
   /* So we're not getting off so easily: it's the case with rewriting.
      Find all relevant strings, and store form 3 and 4 states specially.  */
-  map<vector<string>, set<int> > p;
+  map<vector<int>, set<int>, form_less> p;
   vector<int> form3;
   for(ii = g.begin(); ii != g.end(); ++ii) {
     if (ii->first/n == 3 || ii->first/n == 4)
@@ -392,31 +450,34 @@ int automaton::zero_reach(set<pair<int,vector<string> > > &g,
 
   /* Do a cartesian productish construction on every form 3 and 4 state.  */
   for(int i=form3.size()-1; i>=0; i--) {
-    map<vector<string>, set<int> > p0;
+    map<vector<int>, set<int>, form_less> p0;
     int k = form3[i]%n, form = form3[i]/n;
     
     /* Form 3 states come from form 0 and so transition to forms 1 and 2.
        Form 4 states come from form 1 and so transition only to form 1.
+       These want the breaking closures, which for form 2 are the same
+       as the others.
 
        Zero closures are nonempty, thus the structure here is a bit less general than it might be.
        It also does quite some redundant insertion.  */
+    reach_set &c1 = zero_closure_breaking[k], &c2 = zero_closure[k+2*n];
     if (form == 3)
-      ii = zero_closure[k+2*n].begin();
+      ii = c2.begin();
     else if (form == 4)
-      ii = zero_closure[k+n].begin();
-    while (ii != zero_closure[k+n].end()) {
+      ii = c1.begin();
+    while (ii != c1.end()) {
       /* We only want _strict_ followers of this state.  */
       if (ii->first != k+n && ii->first != k+2*n)
-        for(map<vector<string>, set<int> >::iterator jj=p.begin(); jj!=p.end(); ++jj) {
-          vector<string> s(jj->first);
+        for(map<vector<int>, set<int>, form_less>::iterator jj=p.begin(); jj!=p.end(); ++jj) {
+          vector<int> s(jj->first);
           s.insert(s.end(), ii->second.begin(), ii->second.end());
           p0[s].insert(jj->second.begin(), jj->second.end());
           p0[s].insert(ii->first);
         }
 
       ++ii;
-      if (ii == zero_closure[k+2*n].end())
-        ii = zero_closure[k+n].begin();
+      if (ii == c2.end())
+        ii = c1.begin();
     }
 
     p0.swap(p);
@@ -425,7 +486,7 @@ int automaton::zero_reach(set<pair<int,vector<string> > > &g,
   /* Drop references to the final state q1 in forms 0 and 1; kill altogether
      any sets containing q1 in form 2, unless sporadic.  */
   if (!p.empty())
-    for(map<vector<string>, set<int> >::iterator kk=p.begin(), jj=kk++; jj!=p.end(); jj=kk++) {
+    for(map<vector<int>, set<int>, form_less>::iterator kk=p.begin(), jj=kk++; jj!=p.end(); jj=kk++) {
       set<int>::iterator ll = jj->second.find(aq1);
       if (ll != jj->second.end())
         jj->second.erase(ll);
@@ -445,10 +506,10 @@ int automaton::zero_reach(set<pair<int,vector<string> > > &g,
      as is correct.  */
   int home = m++;
   q.resize(m);
-  for(map<vector<string>, set<int> >::iterator jj=p.begin(); jj!=p.end(); ++jj) {
+  for(map<vector<int>, set<int>, form_less>::iterator jj=p.begin(); jj!=p.end(); ++jj) {
     transition *last = NULL;
-    if(jj->first == vector<string>(0)) {
-      last = new cst_transition("0");
+    if(jj->first == vector<int>(0)) {
+      last = new cst_transition(ZERO_PH);
       q[home].t.push_back(last);
     }
     else {
@@ -456,7 +517,7 @@ int automaton::zero_reach(set<pair<int,vector<string> > > &g,
       for(int i=0; i<jj->first.size(); i++) {
         if(last != NULL)
           last->d = dest;
-        last = new pos_transition("0", jj->first[i]);
+        last = new pos_transition(ZERO_PH, jj->first[i]);
         q[dest].t.push_back(last);
         if (i < jj->first.size()-1) {
           dest = m++;
@@ -468,395 +529,1004 @@ int automaton::zero_reach(set<pair<int,vector<string> > > &g,
   }
 
   //printf("......  created state %d to handle\n",home);
-  //for(set<pair<int,vector<string> > >::iterator kk=g.begin(); kk!=g.end(); ++kk) {
+  //for(reach_set::iterator kk=g.begin(); kk!=g.end(); ++kk) {
   //  printf(" %d",kk->first);
   //  for(int k=kk->second.size()-1; k>=0; k--)
-  //    printf(" %s",kk->second[k].c_str());
+  //    printf(" %s",phone_name[kk->second[k]].c_str());
   //  printf("\n");
   //}  
   
   return home;
 }
 
-/* Perform the modified subset construction on this transducer, to yield
-   one that carries out the sound change.  Note that this does not
-   actually yield a deterministic transducer, i.e. my terminology is bad.
-   Also note that it has a side-effect!
+/* Remove zero-transitions from state i to itself.  */
+void automaton::drop_zero_loops(int i) {
+  for(int j=q[i].t.size()-1; j>=0; j--) {
+    if(q[i].t[j]->kind() == CST_TR && ((cst_transition *)q[i].t[j])->x == vector<int>(1, ZERO_PH) &&
+       q[i].t[j]->d == i) {
+      delete q[i].t[j];
+      q[i].t[j] = q[i].t[q[i].t.size()-1];
+      q[i].t.pop_back();
+    }
+    else if (q[i].t[j]->kind() == POS_TR && ((pos_transition *)q[i].t[j])->x == vector<int>(1, ZERO_PH) &&
+             ((pos_transition *)q[i].t[j])->y == vector<int>(1, ZERO_PH) && q[i].t[j]->d == i) {
+      delete q[i].t[j];
+      q[i].t[j] = q[i].t[q[i].t.size()-1];
+      q[i].t.pop_back();
+    }
+  }
+}
 
-   initial_form should be 0 for standard changes, 2 for constraints
-   which must not be satisfied, and I suppose 1 for constraints
-   that must be satisfied, though I never use this latter option.
-   It can also be 0 for the determinization construction on
-   true automata, without rewriting.  */
-automaton *automaton::determinise(bool not_sporadic, int initial_form, bool respecting_conflicts) {
-  automaton* b = new automaton(0); 
-  int n = q.size();
-  map<set<int>, int> label;
-  int m = 0; // current state in the new automaton
-  deque<set<int> > queue; // things whose transitions we need to create
-  set<int> s;
-  vector<set<pair<int,vector<string> > > > zero_closure(3*n); // three different forms of each state
-  vector<set<pair<int,vector<string> > > > zero_closure_breaking(3*n); // ick, horrible duplication
+/* The setup for the modified subset construction of determinise(),
+   leaving c ready to make the states of the new automaton c.b one at a
+   time; its initial state is made already.  */
+void automaton::start_determinise(subset_construction &c, bool not_sporadic, int initial_form,
+                                  bool respecting_conflicts) {
+  c.b = new automaton(0);
+  int n = c.n = q.size();
+  c.m = 0;
+  c.not_sporadic = not_sporadic;
+  c.respecting_conflicts = respecting_conflicts;
+  vector<reach_set > &zero_closure = c.zero_closure, &zero_closure_breaking = c.zero_closure_breaking;
+  zero_closure.resize(3*n); // three different forms of each state
+  zero_closure_breaking.resize(n); // form 1 only; the rest are the same
   
   /* Add the universal transition on q0.  This is the side-effect.  */
-  transition *loop = new neg_transition(vector<string>(0)); 
+  transition *loop = new neg_transition(vector<int>(0)); 
   loop->d = q0;
   q[q0].t.push_back(loop);
 
+  /* Collect the trigger sets once and for all; the splitting below
+     asks for them over and over.  */
+  vector<vector<forfc<int> > > &trig = c.trig;
+  trig.resize(n);
+  for(int i=n-1; i>=0; i--)
+    for(int j=0; j<q[i].t.size(); j++)
+      trig[i].push_back(q[i].t[j]->trigger_set());
+
   /* For each state, find the zero closure, obtained by taking all transitions
-     which are triggered by zero, including those with output.  */
+     which are triggered by zero, including those with output.  The zero
+     transitions of each state are gathered first, since every closure
+     looks at them.  */
+  vector<vector<zero_edge> > zeros(n);
+  for(int i=n-1; i>=0; i--)
+    for(int j=q[i].t.size()-1; j>=0; j--) {
+      int kind = q[i].t[j]->kind();
+      if((kind == CST_TR || kind == POS_TR) && trig[i][j].contains(ZERO_PH)) {
+        zeros[i].push_back(zero_edge());
+        zeros[i].back().d = q[i].t[j]->d;
+        zeros[i].back().pos = kind == POS_TR;
+        if (kind == POS_TR)
+          zeros[i].back().out = q[i].t[j]->all_outcomes(ZERO_PH);
+      }
+    }
+  vector<int> seen(3*n, -1);
   for(int i=3*n-1; i>=0; i--) {
-    vector<string> closure_tmp(0);
-    zero_close(&zero_closure[i], i, closure_tmp, true, n);
-    zero_close(&zero_closure_breaking[i], i, closure_tmp, false, n);
+    zero_close(&zero_closure[i], i, true, zeros, seen, 2*i, n);
+    if (i/n == 1)
+      zero_close(&zero_closure_breaking[i-n], i, false, zeros, seen, 2*i+1, n);
 
     //printf("(nonbreaking) zero closure of state %d has\n",i);
-    //for(set<pair<int,vector<string> > >::iterator kk=zero_closure[i].begin(); kk!=zero_closure[i].end(); ++kk) {
+    //for(reach_set::iterator kk=zero_closure[i].begin(); kk!=zero_closure[i].end(); ++kk) {
     //  printf(" %d",kk->first);
     //  for(int k=kk->second.size()-1; k>=0; k--)
-    //    printf(" %s",kk->second[k].c_str());
+    //    printf(" %s",phone_name[kk->second[k]].c_str());
     //  printf("\n");
     //}
   }
 
   /* Set the initial state of b to the zero reach of our initial state.  */
-  b->q1 = b->q0 =
-    b->zero_reach(zero_closure[q0 + n*initial_form], zero_closure_breaking, not_sporadic, label, m, queue, q1, n);
+  c.b->q1 = c.b->q0 =
+    c.b->zero_reach(zero_closure[q0 + n*initial_form], zero_closure, zero_closure_breaking, not_sporadic,
+                    c.label, c.m, c.queue, q1, n);
+}
 
-  /* This is the main loop.  */
-  while(!queue.empty()) {
-    s = queue.front();
-    queue.pop_front();
-    //printf("######  working on state %d that is the set", label[s]);
-    //for(set<int>::iterator ii=s.begin(); ii!=s.end(); ++ii)
-    //  printf(" %d",*ii);
-    //printf("\n");
+/* Make the transitions out of the state of c.b made from the kth set in
+   c.label.  If that turns out to be ambiguous, give up and return false.  */
+bool automaton::determine_state(subset_construction &c, int k) {
+  automaton *b = c.b;
+  int n = c.n;
+  state_sets &label = c.label;
+  int &m = c.m;
+  deque<int> &queue = c.queue;
+  vector<vector<forfc<int> > > &trig = c.trig;
+  vector<reach_set > &zero_closure = c.zero_closure, &zero_closure_breaking = c.zero_closure_breaking;
+  bool not_sporadic = c.not_sporadic, respecting_conflicts = c.respecting_conflicts;
+  vector<int> s = label.sets[k];
+  int here = label.state[k]; // the state made of s
+
+  //printf("######  working on state %d that is the set", here);
+  //for(vector<int>::iterator ii=s.begin(); ii!=s.end(); ++ii)
+  //  printf(" %d",*ii);
+  //printf("\n");
 
-    /* Create the set of all triggers for transitions from these states,
-       keeping similarly-behaving phones collected as much as possible.
-       Also handle the special conditions on other forms of states.
+  /* Create the set of all triggers for transitions from these states,
+     keeping similarly-behaving phones collected as much as possible.
+     Also handle the special conditions on other forms of states.
 
-       It's critical to handle zeros specially; we don't treat them here.  */
-    vector<forfc<string> > set0, set1, *tr_old = &set0, *tr_new = &set1, *tr_tmp;
-    tr_old->push_back(forfc<string>("0", false));
-    
-    for(set<int>::iterator ii=s.begin(); ii!=s.end(); ++ii) {
-      int i=*ii%n, form=*ii/n;
-      forfc<string> trigger_union(vector<string>(0), false);
-      for(int j=q[i].t.size()-1; j>=0; j--) {
-        forfc<string> x = q[i].t[j]->trigger_set(), y, z;
-        tr_new->clear();
-        for(vector<forfc<string> >::iterator jj=tr_old->begin(); jj!=tr_old->end(); ++jj) {
-          y = forfc<string>(*jj); y.intersect(x);
-          z = forfc<string>(*jj); z.subtract(x);
-          if (!y.empty() && !(form==2 && q[i].t[j]->d == q1 && not_sporadic)) {
-            tr_new->push_back(y);
-            trigger_union.subtract(x);
-          }
-          if (!z.empty())
-            tr_new->push_back(z);
+     It's critical to handle zeros specially; we don't treat them here.  */
+  vector<forfc<int> > set0, set1, *tr_old = &set0, *tr_new = &set1, *tr_tmp;
+  tr_old->push_back(forfc<int>(ZERO_PH, false));
+  
+  for(vector<int>::iterator ii=s.begin(); ii!=s.end(); ++ii) {
+    /* The fake state -1 from the multiplicity handling below can sneak
+       into state sets.  It has no transitions; don't go looking for them.  */
+    if (*ii < 0)
+      continue;
+    int i=*ii%n, form=*ii/n;
+    forfc<int> trigger_union(vector<int>(0), false);
+    for(int j=q[i].t.size()-1; j>=0; j--) {
+      forfc<int> &x = trig[i][j], y, z;
+      tr_new->clear();
+      for(vector<forfc<int> >::iterator jj=tr_old->begin(); jj!=tr_old->end(); ++jj) {
+        y = forfc<int>(*jj); y.intersect(x);
+        z = forfc<int>(*jj); z.subtract(x);
+        if (!y.empty() && !(form==2 && q[i].t[j]->d == q1 && not_sporadic)) {
+          tr_new->push_back(y);
+          trigger_union.subtract(x);
         }
-        tr_tmp = tr_old; tr_old = tr_new; tr_new = tr_tmp;
+        if (!z.empty())
+          tr_new->push_back(z);
       }
-      /* Handle the special case for form 1 states.  Note that since we've already split
-         on all the things whose union is the complement of trigger_union, everything
-         is either contained in it or disjoint from it.  The ones contained in it,
-         i.e. the ones such that subtracting it leaves them empty, should perish.  */
-      if (form == 1) 
-        for(int k = tr_old->size()-1; k>=0; k--) {
-          (*tr_old)[k].subtract(trigger_union);
-          if ((*tr_old)[k].empty()) {
-            (*tr_old)[k] = (*tr_old)[tr_old->size()-1];
-            tr_old->pop_back();
-          }
-        }      
-    }
-
-    for(vector<forfc<string> >::iterator jj=tr_old->begin(); jj!=tr_old->end(); ++jj) {
-      /* A representative phone from this set.  If it's infinite, we use "*",
-         which is certainly not a phone (because our syntax prevents it), and so
-         in particular is not in any other set.  */
-      string r = jj->pos ? jj->s[0] : "*";
-      set<pair<int,vector<string> > > t; // the set of reachable states, with forms and writings
-      //printf("entering transition generation for the class represented by %s\n", r.c_str());
-      //printf("this class %s", jj->pos ? "contains" : "doesn't contain");
-      //for (int k = jj->s.size()-1; k>=0; k--)
-      //  printf(" %s", jj->s[k].c_str());
-      //printf("\n");
-      
-      /* Multiple outcomes are necessary if:
-         - this state is form 0, and some outgoing transitions rewrite;
-         - this state is form 1, and there are multiple modifications with the
-           same trigger (in form 2, we instead transition to all of them).
-         Our handling of multiple outcomes is uglyish.  */
-      /* Also, don't add any forms of the destination state q1.  */
-      // stores outputs and extra sets for multiple outcomes -- and how 'bout that type?
-      vector<pair<vector<string>, set<pair<int,vector<string> > > > > mult; 
-      int mult_state = -1; // if not -1, then the extended state which needed multiplicity
-      vector<string> mult_string; // the outcome of this transition
-      bool mult_string_valid = false;
-      // stores alternatives for zero transitions from form 1 states
-      vector<set<pair<int,vector<string> > > > zero_mult;
-      bool last_special = false;
-
-      for(set<int>::iterator ii=s.begin(); ii!=s.end(); ++ii) {
-        int i=*ii%n, form=*ii/n;
-        set<pair<int,vector<string> > > magic;
-        bool use_magic = true, took = false; 
-        //printf("in the mess for %d (state %d, form %d)\n", *ii, i, form);
-        for(int j=q[i].t.size()-1; j>=0; j--) {
-          //printf("the transition ", j);
-          //q[i].t[j]->display();
-          //printf("\n");
-          if (q[i].t[j]->trigger_set().contains(r)) {
-            //printf("trigger set contains it\n");
-            if((form == 1 || form == 0) && (q[i].t[j]->kind() == POS_TR || q[i].t[j]->kind() == NER_TR)) {
-              //printf("form is multiplicative\n");
-
-              /* Fail if there's another nontrivial source of multiplicity, because
-                 this guarantees ambiguity.  */
-              if (mult_state != -1 && mult_state != *ii) {
-                if (respecting_conflicts)
-                  return NULL;
-                mult.clear();
-              }
-              mult_state = *ii;
-
-              set<pair<int,vector<string> > > w;
-              /* Default w to {(-1,[])}, which is a fake state we can recognize.
-                 Empty sets don't work for the Cartesian product later.  */
-              if(q[i].t[j]->d != q1) {
-                w = zero_closure[q[i].t[j]->d + n]; // n*1
-                magic.insert(zero_closure[q[i].t[j]->d + n*2].begin(),
-                             zero_closure[q[i].t[j]->d + n*2].end());
-              }
-              else {
-                w.insert(pair<int,vector<string> >(-1, vector<string>()));
-                use_magic = false;
-              }
-              if (form == 0)
-                took = true;
-
-              vector<vector<string> > outcomes;
-              if (jj->pos) {
-                vector<string> one_outcome = vector<string>(jj->s.size());
-                vector<int> iv = vector<int>(jj->s.size()), iu = vector<int>(jj->s.size());
-                int l;
-                for(l=iv.size()-1; l>=0; l--) {
-                  iv[l] = 0; iu[l] = q[i].t[j]->all_outcomes(jj->s[l]).size();
-                }
-                do {
-                  for(int k=jj->s.size()-1; k>=0; k--)
-                    one_outcome[k] = q[i].t[j]->all_outcomes(jj->s[k])[iv[k]];
-                  outcomes.push_back(one_outcome);
-                  for(l=iv.size()-1; l>=0 && ++iv[l]>=iu[l]; l--) iv[l] = 0;
-                } while (l >= 0);
-              }
-              else
-                outcomes = vector<vector<string> >(1, q[i].t[j]->all_outcomes(r));
+      tr_tmp = tr_old; tr_old = tr_new; tr_new = tr_tmp;
+    }
+    /* Handle the special case for form 1 states.  Note that since we've already split
+       on all the things whose union is the complement of trigger_union, everything
+       is either contained in it or disjoint from it.  The ones contained in it,
+       i.e. the ones such that subtracting it leaves them empty, should perish.  */
+    if (form == 1) 
+      for(int k = tr_old->size()-1; k>=0; k--) {
+        (*tr_old)[k].subtract(trigger_union);
+        if ((*tr_old)[k].empty()) {
+          (*tr_old)[k] = (*tr_old)[tr_old->size()-1];
+          tr_old->pop_back();
+        }
+      }      
+  }
 
-              for(vector<vector<string> >::iterator oi=outcomes.begin(); oi!=outcomes.end(); ++oi)
-                mult.push_back(pair<vector<string>, set<pair<int,vector<string> > > >(*oi, w));
+  for(vector<forfc<int> >::iterator jj=tr_old->begin(); jj!=tr_old->end(); ++jj) {
+    /* A representative phone from this set.  If it's infinite, we use "*",
+       which is certainly not a phone (because our syntax prevents it), and so
+       in particular is not in any other set.  */
+    vector<int> js = jj->list();
+    int r = jj->pos ? js[0] : OTHER_PH;
+    reach_set t; // the set of reachable states, with forms and writings
+    //printf("entering transition generation for the class represented by %s\n", phone_name[r].c_str());
+    //printf("this class %s", jj->pos ? "contains" : "doesn't contain");
+    //for (int k = js.size()-1; k>=0; k--)
+    //  printf(" %s", phone_name[js[k]].c_str());
+    //printf("\n");
+    
+    /* Multiple outcomes are necessary if:
+       - this state is form 0, and some outgoing transitions rewrite;
+       - this state is form 1, and there are multiple modifications with the
+         same trigger (in form 2, we instead transition to all of them).
+       Our handling of multiple outcomes is uglyish.  */
+    /* Also, don't add any forms of the destination state q1.  */
+    // stores outputs and extra sets for multiple outcomes -- and how 'bout that type?
+    vector<pair<vector<int>, reach_set > > mult; 
+    int mult_state = -1; // if not -1, then the extended state which needed multiplicity
+    vector<int> mult_string; // the outcome of this transition
+    bool mult_string_valid = false;
+    // stores alternatives for zero transitions from form 1 states
+    vector<reach_set > zero_mult;
+    bool last_special = false;
+
+    for(vector<int>::iterator ii=s.begin(); ii!=s.end(); ++ii) {
+      if (*ii < 0)
+        continue;
+      int i=*ii%n, form=*ii/n;
+      reach_set magic;
+      bool use_magic = true, took = false; 
+      //printf("in the mess for %d (state %d, form %d)\n", *ii, i, form);
+      for(int j=q[i].t.size()-1; j>=0; j--) {
+        //printf("the transition ", j);
+        //q[i].t[j]->display();
+        //printf("\n");
+        if (trig[i][j].contains(r)) {
+          //printf("trigger set contains it\n");
+          if((form == 1 || form == 0) && (q[i].t[j]->kind() == POS_TR || q[i].t[j]->kind() == NER_TR)) {
+            //printf("form is multiplicative\n");
+
+            /* Fail if there's another nontrivial source of multiplicity, because
+               this guarantees ambiguity.  */
+            if (mult_state != -1 && mult_state != *ii) {
+              if (respecting_conflicts)
+                return false;
+              mult.clear();
+            }
+            mult_state = *ii;
+
+            reach_set w;
+            /* Default w to {(-1,[])}, which is a fake state we can recognize.
+               Empty sets don't work for the Cartesian product later.  */
+            if(q[i].t[j]->d != q1) {
+              w = zero_closure[q[i].t[j]->d + n]; // n*1
+              magic.insert(zero_closure[q[i].t[j]->d + n*2].begin(),
+                           zero_closure[q[i].t[j]->d + n*2].end());
             }
-            else { 
-              //printf("form is innocuous, or transition is nonrewriting\n");
-              if(q[i].t[j]->d != q1) {
-                if (form == 1)
-                  zero_mult.push_back(zero_closure[q[i].t[j]->d + n*form]);
-                else
-                  t.insert(zero_closure[q[i].t[j]->d + n*form].begin(),
-                           zero_closure[q[i].t[j]->d + n*form].end());
+            else {
+              w.insert(pair<int,vector<int> >(-1, vector<int>()));
+              use_magic = false;
+            }
+            if (form == 0)
+              took = true;
+
+            vector<vector<int> > outcomes;
+            if (jj->pos) {
+              vector<int> one_outcome = vector<int>(js.size());
+              vector<int> iv = vector<int>(js.size()), iu = vector<int>(js.size());
+              int l;
+              for(l=iv.size()-1; l>=0; l--) {
+                iv[l] = 0; iu[l] = q[i].t[j]->all_outcomes(js[l]).size();
               }
+              do {
+                for(int k=js.size()-1; k>=0; k--)
+                  one_outcome[k] = q[i].t[j]->all_outcomes(js[k])[iv[k]];
+                outcomes.push_back(one_outcome);
+                for(l=iv.size()-1; l>=0 && ++iv[l]>=iu[l]; l--) iv[l] = 0;
+              } while (l >= 0);
+            }
+            else
+              outcomes = vector<vector<int> >(1, q[i].t[j]->all_outcomes(r));
+
+            for(vector<vector<int> >::iterator oi=outcomes.begin(); oi!=outcomes.end(); ++oi)
+              mult.push_back(pair<vector<int>, reach_set >(*oi, w));
+          }
+          else { 
+            //printf("form is innocuous, or transition is nonrewriting\n");
+            if(q[i].t[j]->d != q1) {
+              if (form == 1)
+                zero_mult.push_back(zero_closure[q[i].t[j]->d + n*form]);
+              else
+                t.insert(zero_closure[q[i].t[j]->d + n*form].begin(),
+                         zero_closure[q[i].t[j]->d + n*form].end());
             }
           }
-        } // for j
-          /* this is the constant transformation: if jj->s is finite, it's represented by
-             jj->s, else by the vector containing our fake phone "*".  */
-        if (use_magic && took) {
-            //printf("form was special, so we insert the nonchanging case\n");
-            mult.push_back(pair<vector<string>, set<pair<int,vector<string> > > >
-                           (jj->pos ? jj->s : vector<string>(1, "*"), magic));
-            last_special = true;
         }
+      } // for j
+        /* this is the constant transformation: if the class is finite, it's represented by
+           its phones js, else by the vector containing our fake phone "*".  */
+      if (use_magic && took) {
+          //printf("form was special, so we insert the nonchanging case\n");
+          mult.push_back(pair<vector<int>, reach_set >
+                         (jj->pos ? js : vector<int>(1, OTHER_PH), magic));
+          last_special = true;
+      }
 
-        /* Collapse mult if its size is 1, and reset mult_state.  Test for mult_string failures.
-           If on the other hand mult has size exceeding 1, we assume that the resulting outcomes
-           are always different, so that it's never collapsible.
-
-           In multiplicity handling here and above, if we're simply ignoring conflicts,
-           then we simply discard the current mult when something else arises.  */
-        if (mult_string_valid && mult.size() > 1) {
-          if (respecting_conflicts)
-            return NULL;
-          mult.clear();
-          mult_state = -1;
-        }
-        else if (mult_string_valid && mult.size() == 1 && mult.begin()->first != mult_string) {
-          if (respecting_conflicts)
-            return NULL;
-          mult.clear();
-          mult_state = -1;
-        }
-        if (mult.size() == 1) {
-          //printf("converting from a multiplicity of size 1\n");
-          if (last_special)
-            t.insert(mult.begin()->second.begin(), mult.begin()->second.end());
+      /* Collapse mult if its size is 1, and reset mult_state.  Test for mult_string failures.
+         If on the other hand mult has size exceeding 1, we assume that the resulting outcomes
+         are always different, so that it's never collapsible.
+
+         In multiplicity handling here and above, if we're simply ignoring conflicts,
+         then we simply discard the current mult when something else arises.  */
+      if (mult_string_valid && mult.size() > 1) {
+        if (respecting_conflicts)
+          return false;
+        mult.clear();
+        mult_state = -1;
+      }
+      else if (mult_string_valid && mult.size() == 1 && mult.begin()->first != mult_string) {
+        if (respecting_conflicts)
+          return false;
+        mult.clear();
+        mult_state = -1;
+      }
+      if (mult.size() == 1) {
+        //printf("converting from a multiplicity of size 1\n");
+        if (last_special)
+          t.insert(mult.begin()->second.begin(), mult.begin()->second.end());
+        else
+          zero_mult.push_back(mult.begin()->second);
+        last_special = false;
+        mult_state = -1;
+        mult_string = mult.begin()->first;
+        mult_string_valid = true;
+        mult.clear();
+      }
+    } // for j
+
+    /* Create the transitions in b.  */
+    vector<pair<vector<int>, reach_set > >::iterator kk = mult.begin(),
+      lastkk = mult.end();
+    lastkk--;
+    do {
+      reach_set t1(t);
+      vector<reach_set > zero_mult0(zero_mult);
+      vector<int> outcomes;
+      if (mult_state != -1) {
+        if (last_special && kk == lastkk)
+          t1.insert(kk->second.begin(), kk->second.end());
+        else
+          zero_mult0.push_back(kk->second);
+        outcomes = kk->first;
+      }
+      else if (mult_string_valid)
+        outcomes = mult_string;
+      else
+        outcomes = vector<int>(1, OTHER_PH); // for constant
+
+      /* Loop over all zero outcomes for type 1 states.  */
+      vector<reach_set::iterator> iiv(zero_mult0.size());
+      int iiv_i;
+      for(int i=0; i<iiv.size(); i++)
+          iiv[i] = zero_mult0[i].begin();
+      do { 
+        reach_set t0(t1);
+        /* Don't insert -1s; they're not for real.  */
+        for(int i=iiv.size()-1; i>=0; i--)
+          if (iiv[i]->first != -1)
+            t0.insert(*iiv[i]);
+        
+        transition *tr;
+        if(jj->pos) {
+          if(outcomes[0] == OTHER_PH)
+            tr = new cst_transition(js);
           else
-            zero_mult.push_back(mult.begin()->second);
-          last_special = false;
-          mult_state = -1;
-          mult_string = mult.begin()->first;
-          mult_string_valid = true;
-          mult.clear();
+            tr = new pos_transition(js, outcomes);
         }
-      } // for j
-
-      /* Create the transitions in b.  */
-      vector<pair<vector<string>, set<pair<int,vector<string> > > > >::iterator kk = mult.begin(),
-        lastkk = mult.end();
-      lastkk--;
-      do {
-        set<pair<int,vector<string> > > t1(t);
-        vector<set<pair<int,vector<string> > > > zero_mult0(zero_mult);
-        vector<string> outcomes;
-        if (mult_state != -1) {
-          if (last_special && kk == lastkk)
-            t1.insert(kk->second.begin(), kk->second.end());
+        else {
+          if(outcomes[0] == OTHER_PH)
+            tr = new neg_transition(js);
           else
-            zero_mult0.push_back(kk->second);
-          outcomes = kk->first;
+            tr = new ner_transition(js, outcomes[0]);
         }
-        else if (mult_string_valid)
-          outcomes = mult_string;
-        else
-          outcomes = vector<string>(1, "*"); // for constant
-
-        /* Loop over all zero outcomes for type 1 states.  */
-        vector<set<pair<int,vector<string> > >::iterator> iiv(zero_mult0.size());
-        int iiv_i;
-        for(int i=0; i<iiv.size(); i++)
-            iiv[i] = zero_mult0[i].begin();
-        do { 
-          set<pair<int,vector<string> > > t0(t1);
-          /* Don't insert -1s; they're not for real.  */
-          for(int i=iiv.size()-1; i>=0; i--)
-            if (iiv[i]->first != -1)
-              t0.insert(*iiv[i]);
-          
-          transition *tr;
-          if(jj->pos) {
-            if(outcomes[0] == "*")
-              tr = new cst_transition(jj->s);
-            else
-              tr = new pos_transition(jj->s, outcomes);
-          }
-          else {
-            if(outcomes[0] == "*")
-              tr = new neg_transition(jj->s);
-            else
-              tr = new ner_transition(jj->s, outcomes[0]);
-          }
-          
-          tr->d = b->zero_reach(t0, zero_closure_breaking, not_sporadic, label, m, queue, q1, n);
-          b->q[label[s]].t.push_back(tr);
-
-          /* Prepare for the next set of zero transitions for form 1 states.  */
-          for(iiv_i = iiv.size()-1; iiv_i>=0 && ++iiv[iiv_i]==zero_mult0[iiv_i].end(); iiv_i--)
-            iiv[iiv_i] = zero_mult0[iiv_i].begin();
-        } while (iiv_i >= 0);
-      } while (mult_state != -1 && ++kk != mult.end());
-      
-    } // for jj
-  } // while queue nonempty
-
-  /* Last step: do some trimming.  First remove zero-transitions to the same state.
-     Then remove states that are nonaccepting and have no transitions to a different state
-     (this isn't quite all that could be done, but it catches a lot).  */
+        
+        tr->d = b->zero_reach(t0, zero_closure, zero_closure_breaking, not_sporadic, label, m, queue, q1, n);
+        b->q[here].t.push_back(tr);
+
+        /* Prepare for the next set of zero transitions for form 1 states.  */
+        for(iiv_i = iiv.size()-1; iiv_i>=0 && ++iiv[iiv_i]==zero_mult0[iiv_i].end(); iiv_i--)
+          iiv[iiv_i] = zero_mult0[iiv_i].begin();
+      } while (iiv_i >= 0);
+    } while (mult_state != -1 && ++kk != mult.end());
+    
+  } // for jj
+
+  return true;
+}
+
+
+/* Perform the modified subset construction on this transducer, to yield
+   one that carries out the sound change.  Note that this does not
+   actually yield a deterministic transducer, i.e. my terminology is bad.
+   Also note that it has a side-effect!
+
+   initial_form should be 0 for standard changes, 2 for constraints
+   which must not be satisfied, and I suppose 1 for constraints
+   that must be satisfied, though I never use this latter option.
+   It can also be 0 for the determinization construction on
+   true automata, without rewriting.  */
+automaton *automaton::determinise(bool not_sporadic, int initial_form, bool respecting_conflicts) {
+  subset_construction c;
+  start_determinise(c, not_sporadic, initial_form, respecting_conflicts);
+  automaton *b = c.b;
+
+  /* This is the main loop.  */
+  while(!c.queue.empty()) {
+    int k = c.queue.front();
+    c.queue.pop_front();
+    if (!determine_state(c, k))
+      return NULL;
+  }
+
+  /* Last step: do some trimming.  */
   for(int i=b->q.size()-1; i>=0; i--)
-    for(int j=b->q[i].t.size()-1; j>=0; j--) {
-      if(b->q[i].t[j]->kind() == CST_TR && ((cst_transition *)b->q[i].t[j])->x == vector<string>(1, "0") &&
-         b->q[i].t[j]->d == i) {
-        delete b->q[i].t[j];
-        b->q[i].t[j] = b->q[i].t[b->q[i].t.size()-1];
-        b->q[i].t.pop_back();
-      }
-      else if (b->q[i].t[j]->kind() == POS_TR && ((pos_transition *)b->q[i].t[j])->x == vector<string>(1, "0") &&
-               ((pos_transition *)b->q[i].t[j])->y == vector<string>(1, "0") && b->q[i].t[j]->d == i) {
-        delete b->q[i].t[j];
-        b->q[i].t[j] = b->q[i].t[b->q[i].t.size()-1];
-        b->q[i].t.pop_back();
-      }       
-    }
+    b->drop_zero_loops(i);
 
-  /* temporary!!!!!!!!!!!!!!!! */
+  /* Dead states aren't pruned here: deleting states one at a time means
+     renumbering all the transitions each time.  minimise() does that, and
+     more, once the automaton is compiled.  */
   return b;
+}
+
+
+
+/* Lay this (finished) automaton out as a flat_table.  The transition
+   objects are left alone, for display() and the like.  */
+void automaton::compile() {
+  f = flat_table();
+  f.first.push_back(0);
+  for(int i=0; i<q.size(); i++)
+    flatten(i);
+}
+
+/* Add state i to the end of the flat table, with its transitions' own
+   destinations.  */
+void automaton::flatten(int i) {
+  f.accept.push_back(q[i].accept);
+  for(int j=q[i].t.size()-1; j>=0; j--) {
+    transition *tr = q[i].t[j];
+    flat_transition ft;
+    ft.d = tr->d;
+    ft.lo = f.x.size();
+    ft.out = -1;
+    vector<pair<int, int> > v;
+    switch (tr->kind()) {
+      case POS_TR:
+        for(int k=((pos_transition *)tr)->x.size()-1; k>=0; k--)
+          v.push_back(pair<int, int>(((pos_transition *)tr)->x[k], ((pos_transition *)tr)->y[k]));
+        ft.pos = true;
+        break;
+      case CST_TR:
+        for(int k=((cst_transition *)tr)->x.size()-1; k>=0; k--)
+          v.push_back(pair<int, int>(((cst_transition *)tr)->x[k], ((cst_transition *)tr)->x[k]));
+        ft.pos = true;
+        break;
+      case NEG_TR:
+        for(int k=((neg_transition *)tr)->z.size()-1; k>=0; k--)
+          v.push_back(pair<int, int>(((neg_transition *)tr)->z[k], -1));
+        ft.pos = false;
+        break;
+      case NER_TR:
+        for(int k=((ner_transition *)tr)->z.size()-1; k>=0; k--)
+          v.push_back(pair<int, int>(((ner_transition *)tr)->z[k], -1));
+        ft.pos = false;
+        ft.out = ((ner_transition *)tr)->s;
+        break;
+      default:
+        continue; // split transitions never survive to here
+    }
+    sort(v.begin(), v.end());
+    for(int k=0; k<v.size(); k++) {
+      f.x.push_back(v[k].first);
+      f.y.push_back(v[k].second);
+    }
+    ft.hi = f.x.size();
+    f.t.push_back(ft);
+  }
+  f.first.push_back(f.t.size());
+  f.index();
+}
 
-  bool any_pruned;
-  do {
-    any_pruned = false;
-    for(int i=b->q.size()-1; i>=0; i--)
-      if (!b->q[i].accept) {
-        bool no_transition_out = true;
-        for(int j=b->q[i].t.size()-1; j>=0; j--)
-          if(b->q[i].t[j]->d != i) {
-            no_transition_out=false;
-            break;
+/* The biggest dense lookup worth having, in entries.  */
+static const size_t max_dense = 1 << 20;
+
+/* Bring the indexes up to date with the states in the table.  States
+   only ever get added, so only the new ones are looked at, unless the
+   lookup has to be laid out again: because dense got too big, or a new
+   state mentions a phone too big for it.  */
+void flat_table::index() {
+  if (zfirst.empty()) {
+    zfirst.push_back(0);
+    kfirst.push_back(0);
+    rfirst.push_back(0);
+    ofirst.push_back(0);
+  }
+  int from = kfirst.size() - 1, w = width;
+  for(int i=from; i<accept.size(); i++) {
+    vector<int> ks;
+    for(int j=first[i]; j<first[i+1]; j++) {
+      for(int k=t[j].lo; k<t[j].hi; k++) {
+        /* Zero is the smallest phone, so its outcomes come first in the run.
+           It's a key as well, for a zero in the word itself.  */
+        if (x[k] == ZERO_PH && t[j].pos) {
+          flat_move v = {j, y[k]};
+          z.push_back(v);
+        }
+        ks.push_back(x[k]);
+      }
+      if (!t[j].pos) {
+        flat_move v = {j, t[j].out};
+        o.push_back(v);
+      }
+    }
+    zfirst.push_back(z.size());
+    ofirst.push_back(o.size());
+    if (zfirst[i+1] > zfirst[i] || ofirst[i+1] > ofirst[i] + 1)
+      sequential = false;
+
+    sort(ks.begin(), ks.end());
+    ks.erase(unique(ks.begin(), ks.end()), ks.end());
+    for(int l=0; l<ks.size(); l++) {
+      int r = ks[l];
+      for(int j=first[i]; j<first[i+1]; j++) {
+        const int *lo = x.data() + t[j].lo, *hi = x.data() + t[j].hi;
+        if (t[j].pos)
+          for(const int *k=lower_bound(lo, hi, r); k<hi && *k == r; k++) {
+            flat_move v = {j, y[k - x.data()]};
+            m.push_back(v);
           }
-        if(no_transition_out) {
-          b->delete_state(i);
-          any_pruned = true;
+        else if (!binary_search(lo, hi, r)) {
+          flat_move v = {j, t[j].out == -1 ? r : t[j].out};
+          m.push_back(v);
         }
       }
-  } while (any_pruned);
+      key.push_back(r);
+      rfirst.push_back(m.size());
+      if (rfirst[key.size()] > rfirst[key.size()-1] + 1)
+        sequential = false;
+      w = max(w, r + 1);
+    }
+    kfirst.push_back(key.size());
+  }
+
+  if (!hashed && (size_t)accept.size() * w > max_dense) {
+    hashed = true;
+    dense.clear();
+    hkey.assign(16, ~0ULL);
+    hval.assign(16, -1);
+    from = 0;
+  }
+  if (!hashed && w != width) {
+    width = w;
+    dense.clear();
+    from = 0;
+  }
+  if (!hashed)
+    dense.resize((size_t)accept.size() * width, -1);
+  for(int i=from; i<accept.size(); i++)
+    place(i);
+}
+
+/* Put state i's keys in the lookup.  */
+void flat_table::place(int i) {
+  for(int k=kfirst[i]; k<kfirst[i+1]; k++) {
+    if (!hashed) {
+      dense[(size_t)i * width + key[k]] = k;
+      continue;
+    }
+    if (2 * (hused + 1) > hkey.size())
+      grow();
+    uint64_t h = ((uint64_t)i << 32) | (unsigned)key[k];
+    size_t n = hkey.size() - 1, l = mix(h) & n;
+    for(; hkey[l] != ~0ULL; l=(l+1) & n);
+    hkey[l] = h;
+    hval[l] = k;
+    hused++;
+  }
+}
 
+void flat_table::grow() {
+  vector<uint64_t> k0;
+  vector<int> v0;
+  k0.swap(hkey);
+  v0.swap(hval);
+  hkey.assign(2 * k0.size(), ~0ULL);
+  hval.assign(hkey.size(), -1);
+  size_t n = hkey.size() - 1;
+  for(size_t j=0; j<k0.size(); j++)
+    if (k0[j] != ~0ULL) {
+      size_t l = mix(k0[j]) & n;
+      for(; hkey[l] != ~0ULL; l=(l+1) & n);
+      hkey[l] = k0[j];
+      hval[l] = v0[j];
+    }
+}
+
+
+
+/* Shrink the flat table without changing what it does.  States that
+   can't be reached from q0, or from which no accepting state can be
+   reached, go, along with the transitions into them.  Then states with
+   identical futures (the same acceptance, and transitions with the same
+   labels to equivalent states) are merged, by refining a partition until
+   it stops splitting.  A state with zero transitions out is never merged,
+   since apply_zeros() counts visits to states along zero paths and two
+   states on the same path mustn't be counted as one.  The survivors are
+   numbered breadth first from q0, which becomes 0, and equal labels share
+   their run of the pools.  */
+void automaton::minimise() {
+  int n = f.accept.size();
+  vector<char> reach(n, 0), live(n, 0);
+  vector<vector<int> > back(n);
+  vector<int> stack(1, q0);
+  reach[q0] = 1;
+  while (!stack.empty()) {
+    int s = stack.back();
+    stack.pop_back();
+    for(int j=f.first[s]; j<f.first[s+1]; j++)
+      if (!reach[f.t[j].d]) {
+        reach[f.t[j].d] = 1;
+        stack.push_back(f.t[j].d);
+      }
+  }
+  for(int s=0; s<n; s++) {
+    for(int j=f.first[s]; j<f.first[s+1]; j++)
+      back[f.t[j].d].push_back(s);
+    if (f.accept[s]) {
+      live[s] = 1;
+      stack.push_back(s);
+    }
+  }
+  while (!stack.empty()) {
+    int s = stack.back();
+    stack.pop_back();
+    for(int k=0; k<back[s].size(); k++)
+      if (!live[back[s][k]]) {
+        live[back[s][k]] = 1;
+        stack.push_back(back[s][k]);
+      }
+  }
+  vector<char> useful(n);
+  for(int s=0; s<n; s++)
+    useful[s] = (reach[s] && live[s]) || s == q0;
+
+  /* Number the distinct labels: pos, out, then the runs of x and y.  */
+  map<vector<int>, int> label;
+  vector<const vector<int> *> labels;
+  vector<int> run(f.t.size());
+  for(int j=0; j<f.t.size(); j++) {
+    const flat_transition &t = f.t[j];
+    vector<int> v;
+    v.push_back(t.pos);
+    v.push_back(t.out);
+    v.insert(v.end(), f.x.begin() + t.lo, f.x.begin() + t.hi);
+    v.insert(v.end(), f.y.begin() + t.lo, f.y.begin() + t.hi);
+    pair<map<vector<int>, int>::iterator, bool> ii = label.insert(pair<vector<int>, int>(v, labels.size()));
+    if (ii.second)
+      labels.push_back(&ii.first->first);
+    run[j] = ii.first->second;
+  }
+
+  vector<int> cls(n, -1);
+  vector<vector<pair<int, int> > > out(n);
+  int classes = 0;
+  for(int s=0; s<n; s++)
+    if (useful[s]) {
+      bool zero_out = false;
+      for(int j=f.first[s]; j<f.first[s+1] && !zero_out; j++)
+        zero_out = f.t[j].pos && f.x[f.t[j].lo] == ZERO_PH;
+      cls[s] = zero_out ? 2 + s : f.accept[s];
+    }
+  for(;;) {
+    map<pair<int, vector<pair<int, int> > >, int> sig;
+    vector<int> next(n, -1);
+    for(int s=0; s<n; s++) {
+      if (!useful[s])
+        continue;
+      vector<pair<int, int> > &v = out[s];
+      v.clear();
+      for(int j=f.first[s]; j<f.first[s+1]; j++)
+        if (useful[f.t[j].d])
+          v.push_back(pair<int, int>(run[j], cls[f.t[j].d]));
+      sort(v.begin(), v.end());
+      v.erase(unique(v.begin(), v.end()), v.end());
+      next[s] = sig.insert(pair<pair<int, vector<pair<int, int> > >, int>
+                           (pair<int, vector<pair<int, int> > >(cls[s], v), sig.size())).first->second;
+    }
+    /* out[] is in terms of cls, so keep cls if nothing split.  */
+    if (sig.size() == classes)
+      break;
+    cls.swap(next);
+    classes = sig.size();
+  }
+
+  /* Lay out one representative of each class.  */
+  vector<int> rep(classes, -1), num(classes, -1), order;
+  for(int s=0; s<n; s++)
+    if (useful[s] && rep[cls[s]] == -1)
+      rep[cls[s]] = s;
+  num[cls[q0]] = 0;
+  order.push_back(cls[q0]);
+  for(int k=0; k<order.size(); k++) {
+    const vector<pair<int, int> > &v = out[rep[order[k]]];
+    for(int l=0; l<v.size(); l++)
+      if (num[v[l].second] == -1) {
+        num[v[l].second] = order.size();
+        order.push_back(v[l].second);
+      }
+  }
+
+  flat_table g;
+  vector<pair<int, int> > pool(labels.size(), pair<int, int>(-1, -1));
+  for(int k=0; k<order.size(); k++) {
+    int s = rep[order[k]];
+    g.first.push_back(g.t.size());
+    g.accept.push_back(f.accept[s]);
+    const vector<pair<int, int> > &v = out[s];
+    for(int l=0; l<v.size(); l++) {
+      const vector<int> &w = *labels[v[l].first];
+      int m = (w.size() - 2) / 2;
+      if (pool[v[l].first].first == -1) {
+        pool[v[l].first].first = g.x.size();
+        g.x.insert(g.x.end(), w.begin() + 2, w.begin() + 2 + m);
+        g.y.insert(g.y.end(), w.begin() + 2 + m, w.end());
+        pool[v[l].first].second = g.x.size();
+      }
+      flat_transition t;
+      t.d = num[v[l].second];
+      t.pos = w[0];
+      t.out = w[1];
+      t.lo = pool[v[l].first].first;
+      t.hi = pool[v[l].first].second;
+      g.t.push_back(t);
+    }
+  }
+  g.first.push_back(g.t.size());
+  f = g;
+  f.index();
+  q0 = q1 = 0;
+}
+
+/* Like determinise(), but only the initial state is made now; the rest
+   are made as transduce() first reaches them (see materialise()), so
+   that the cost is only that of the part of the change that's used.
+   The result has only a flat table, in which states are numbered in
+   the order they were reached.  NULL if even the initial state is
+   ambiguous.  This automaton is kept as part of the result.  */
+automaton *automaton::determinise_lazily(bool not_sporadic, int initial_form, bool respecting_conflicts) {
+  lazy_states *z = new lazy_states;
+  z->a = this;
+  z->conflict = false;
+  pthread_mutex_init(&z->lock, NULL);
+  start_determinise(z->c, not_sporadic, initial_form, respecting_conflicts);
+
+  automaton *b = z->c.b;
+  b->lazy = z;
+  b->f.first.push_back(0);
+  int start = b->q0;
+  b->q0 = b->q1 = b->materialise(start);
+  if (z->conflict)
+    return NULL;
   return b;
 }
 
+/* The flat table number of state x, made now if it hasn't been, or -1
+   if that turns out to be ambiguous.  */
+int automaton::materialise(int x) {
+  lazy_states *z = lazy;
+  if (x < z->flat.size() && z->flat[x] != -1)
+    return z->flat[x];
+
+  /* Note which states are to be made from which sets.  */
+  for(; !z->c.queue.empty(); z->c.queue.pop_front()) {
+    int k = z->c.queue.front(), r = z->c.label.state[k];
+    if (z->set.size() <= r)
+      z->set.resize(r+1, -1);
+    z->set[r] = k;
+  }
+  if (x < z->set.size() && z->set[x] != -1) {
+    int k = z->set[x];
+    z->set[x] = -1;
+    if (!z->a->determine_state(z->c, k)) {
+      z->conflict = true;
+      return -1;
+    }
+  }
+  drop_zero_loops(x);
+
+  if (z->flat.size() < q.size())
+    z->flat.resize(q.size(), -1);
+  int r = z->flat[x] = f.accept.size(), j = f.t.size();
+  flatten(x);
+  for(; j<f.t.size(); j++)
+    if (z->flat[f.t[j].d] != -1)
+      f.t[j].d = z->flat[f.t[j].d];
+    else
+      f.t[j].d = -1 - f.t[j].d;
+  return r;
+}
 
+/* Make the destination of f.t[j] if it hasn't been, and return it.  */
+int automaton::resolve(int j) {
+  int r = materialise(-1 - f.t[j].d);
+  if (r != -1)
+    f.t[j].d = r;
+  return r;
+}
 
-/* Do the zero application thing.  */
-void automaton::apply_zeros(const application *a, set<application> *s, vector<int> &c, int max_epen) {
-  vector<int> d(c);
-  
-  /* Look for transitions triggered by _finite sets_ including 0.
-     If there are none, or if we've exceeded max_epen visits here,
-     insert this application and stop.  Otherwise recurse onto all
-     these transitions.  */
-  d[a->q]++;
-  if(d[a->q] > max_epen) {
-    s->insert(*a);
-    return;
+void out_arena::grow() {
+  slot.assign(2 * slot.size(), -1);
+  size_t m = slot.size() - 1;
+  for(int k=1; k<parent.size(); k++) {
+    size_t i = mix(((uint64_t)parent[k] << 32) | (unsigned)phone[k]) & m;
+    for(; slot[i] != -1; i=(i+1) & m);
+    slot[i] = k;
   }
+}
 
-  string zero = "0";
-  for(int j=q[a->q].t.size()-1; j>=0; j--)
-    if(q[a->q].t[j]->trigger_set().contains(zero) &&
-       (q[a->q].t[j]->kind() == POS_TR || q[a->q].t[j]->kind() == CST_TR)) {
-      vector<string> u = q[a->q].t[j]->all_outcomes("0"); 
-      for(int k=u.size()-1; k>=0; k--) {
-        vector<string> w(a->y);
-        if (u[k] != "0") {
-          w.push_back(u[k]);
-        }
-        application b(w, q[a->q].t[j]->d);
-        apply_zeros(&b, s, d, max_epen);
+/* Write out the output n into v.  */
+void out_arena::spell(int n, vector<int> &v) const {
+  v.clear();
+  for(; n > 0; n = parent[n])
+    v.push_back(phone[n]);
+  reverse(v.begin(), v.end());
+}
+
+void frontier::grow() {
+  key.assign(2 * key.size(), 0);
+  stamp.assign(key.size(), 0);
+  gen = 1;
+  size_t m = key.size() - 1;
+  for(int j=0; j<a.size(); j++) {
+    uint64_t k = ((uint64_t)a[j].first << 32) | (unsigned)a[j].second;
+    size_t i = mix(k) & m;
+    for(; stamp[i] == gen; i=(i+1) & m);
+    stamp[i] = gen;
+    key[i] = k;
+  }
+}
+
+/* Put d as it is, with q about to go on the path, into prof: its length,
+   then the states of the path, sorted.  Say where it went.  */
+size_t zero_search::remember(int q) {
+  size_t a = prof.size();
+  prof.push_back(path.size() + 1);
+  for(int j=0; j<path.size(); j++)
+    prof.push_back(path[j].q);
+  prof.push_back(q);
+  sort(prof.begin() + a + 1, prof.end());
+  return a;
+}
+
+/* Whether the d remembered at a is d as it is now, with q about to go on
+   the path.  As long as they've as many visits in all, it's enough that
+   each state remembered has as many visits now as it had then.  */
+bool zero_search::same(size_t a, int q) const {
+  if (prof[a] != path.size() + 1)
+    return false;
+  for(size_t j=a+1, e=a+1+prof[a], c; j<e; j+=c) {
+    for(c=1; j+c<e && prof[j+c] == prof[j]; c++);
+    if (d[prof[j]] != c)
+      return false;
+  }
+  return true;
+}
+
+void zero_search::grow() {
+  vector<uint64_t> k0, h0;
+  vector<size_t> a0;
+  vector<unsigned> s0;
+  k0.swap(key);
+  h0.swap(hash);
+  a0.swap(at);
+  s0.swap(stamp);
+  key.assign(2 * k0.size(), 0);
+  hash.assign(key.size(), 0);
+  at.assign(key.size(), 0);
+  stamp.assign(key.size(), 0);
+  size_t m = key.size() - 1;
+  for(size_t j=0; j<k0.size(); j++)
+    if (s0[j] == gen) {
+      size_t i = mix(k0[j] ^ h0[j]) & m;
+      for(; stamp[i] == 1; i=(i+1) & m);
+      stamp[i] = 1;
+      key[i] = k0[j];
+      hash[i] = h0[j];
+      at[i] = a0[j];
+    }
+  gen = 1;
+}
+
+/* Do the zero application thing, to the application of state q with
+   output n: follow transitions triggered by _finite sets_ including 0,
+   in all combinations, putting every application met along the way in
+   s, except that a state is left as it is once it's been visited more
+   than max_epen times on the way to it.  */
+void automaton::apply_zeros(int q, int n, out_arena &o, frontier *s, zero_search &z, int max_epen, transduce_stats *st) {
+  bool visit = true;
+  while (1) {
+    /* Visit q with output n, unless we've been here before.  */
+    if (visit) {
+      if (q >= z.d.size()) // a lazy automaton has grown
+        z.d.resize(f.accept.size(), 0);
+      uint64_t r = mix(q) | 1;
+      z.d[q]++;
+      z.h += r;
+      if (z.d[q] > max_epen)
+        s->insert(q, n);
+      if (z.d[q] > max_epen || !z.see(q, n)) {
+        z.d[q]--;
+        z.h -= r;
+      }
+      else {
+        if (st)
+          st->zero_calls++;
+        zero_frame g = {q, n, f.zfirst[q], f.zfirst[q+1]};
+        z.path.push_back(g);
       }
     }
 
-  s->insert(*a);
+    /* Take the next zero move from the end of the path, backing up past
+       states that have none left.  */
+    while (!z.path.empty() && z.path.back().k == z.path.back().end) {
+      zero_frame &g = z.path.back();
+      s->insert(g.q, g.n);
+      z.d[g.q]--;
+      z.h -= mix(g.q) | 1;
+      z.path.pop_back();
+    }
+    if (z.path.empty())
+      return;
+    zero_frame &g = z.path.back();
+    flat_move m = f.z[g.k++]; // a copy, since a lazy automaton's table can grow
+    visit = f.t[m.j].d >= 0 || resolve(m.j) >= 0;
+    if (visit) {
+      q = f.t[m.j].d;
+      n = m.y != ZERO_PH ? o.extend(g.n, m.y) : g.n;
+    }
+  }
+}
+
+/* Apply zeros to each application in s, putting the results in t.  */
+void automaton::close_zeros(const frontier *s, frontier *t, out_arena &o, zero_search &z, int max_epen, transduce_stats *st) {
+  z.clear();
+  for(int j=0; j<s->a.size(); j++)
+    apply_zeros(s->a[j].first, s->a[j].second, o, t, z, max_epen, st);
+  if (st)
+    st->count(t);
+}
+
+/* Apply all transitions with the trigger r to the applications in s,
+   putting the results in t.  */
+void automaton::step(const frontier *s, int r, frontier *t, out_arena &o) {
+  for(int i=0; i<s->a.size(); i++) {
+    int q = s->a[i].first, n = s->a[i].second;
+    int k = f.find(q, r);
+    const vector<flat_move> &v = k >= 0 ? f.m : f.o;
+    int lo = k >= 0 ? f.rfirst[k] : f.ofirst[q], hi = k >= 0 ? f.rfirst[k+1] : f.ofirst[q+1];
+    for(int l=lo; l<hi; l++) {
+      flat_move u = v[l]; // a copy, since a lazy automaton's table can grow
+      if (f.t[u.j].d < 0 && resolve(u.j) < 0)
+        continue;
+      int y = u.y == -1 ? r : u.y;
+      t->insert(f.t[u.j].d, y != ZERO_PH ? o.extend(n, y) : n);
+    }
+  }
 }
 
-/* Return the set of all strings that a given string transduces to.  */
-set<vector<string> > *automaton::transduce(vector<string> *x, int max_epen, bool reflect) {
+/* For a sequential automaton (see flat_table): the one output of x, in y,
+   or false if there isn't one.  If reflect is set x is read backwards,
+   and y comes out backwards too, as in transduce().  */
+bool automaton::transduce_sequential(const vector<int> &x, vector<int> &y, bool reflect) {
+  y.clear();
+  int q = q0, n = x.size();
+  for(int i=0; i<n; i++) {
+    int r = x[reflect ? n-1-i : i];
+    int k = f.find(q, r);
+    int l = k >= 0 ? f.rfirst[k] : f.ofirst[q];
+    if (l == (k >= 0 ? f.rfirst[k+1] : f.ofirst[q+1]))
+      return false;
+    const flat_move &u = k >= 0 ? f.m[l] : f.o[l];
+    int v = u.y == -1 ? r : u.y;
+    if (v != ZERO_PH)
+      y.push_back(v);
+    q = f.t[u.j].d;
+  }
+  if (!f.accept[q])
+    return false;
   if (reflect)
-    reverse(x->begin(), x->end());
+    reverse(y.begin(), y.end());
+  return true;
+}
+
+/* The outputs of the applications in s that have finished in an
+   accepting state.  */
+form_set *automaton::accepted(const frontier *s, const out_arena &o, bool reflect) {
+  form_set *r = new form_set;
+  vector<int> v;
+  for(int j=0; j<s->a.size(); j++)
+    if (f.accept[s->a[j].first]) {
+      o.spell(s->a[j].second, v);
+      if (reflect)
+        reverse(v.begin(), v.end());
+      r->insert(v);      
+    }
+  return r;
+}
 
-  set<application> s0, s1, s2, *s_old = &s0, *s_new = &s1, *s_mid = &s2;
-  s_old->insert(application(vector<string>(0), q0));
+/* Return the set of all strings that a given string transduces to.  If st
+   isn't NULL, what it took is added to it.  If this is a lazy automaton
+   and x reaches an ambiguous state, return NULL.  A sequential automaton
+   needs none of the frontiers.  */
+form_set *automaton::transduce(vector<int> *x, int max_epen, bool reflect, transduce_stats *st) {
+  if (sequential()) {
+    form_set *r = new form_set;
+    vector<int> y;
+    if (transduce_sequential(*x, y, reflect))
+      r->insert(y);
+    return r;
+  }
+  if (reflect)
+    reverse(x->begin(), x->end());
+  if (lazy)
+    pthread_mutex_lock(&lazy->lock);
 
-  //printf("initially: ");
-  //s_old->begin()->display();
-  //printf("\n");
+  out_arena o;
+  zero_search z;
+  frontier s0, s1, s2, *s_old = &s0, *s_new = &s1, *s_mid = &s2;
+  s_old->insert(q0, 0);
   
   for(int i=0; ; i++) {
     //printf("on phone %d\n", i);
@@ -865,60 +1535,98 @@ set<vector<string> > *automaton::transduce(vector<string> *x, int max_epen, bool
        that present themselves, subject to the condition that, after having
        returned to a state for the > max_epen th time, we stop.
        Put the results in s_mid.  */
-    for(set<application>::iterator ii=s_old->begin(); ii!=s_old->end(); ++ii) {
-      vector<int> c(q.size(), 0);
-      apply_zeros(&*ii, s_mid, c, max_epen);
-    }
-
-    //printf("after zeros:");
-    //for(set<application>::iterator ii=s_mid->begin(); ii!=s_mid->end(); ++ii) {
-    //  printf(" ");
-    //  ii->display();
-    //}
-    //printf("\n");
+    close_zeros(s_old, s_mid, o, z, max_epen, st);
 
     if (i == x->size())
       break;
 
-    string r = (*x)[i];
-    //printf("the phone is \"%s\"\n", r.c_str());
+    //printf("the phone is \"%s\"\n", phone_name[(*x)[i]].c_str());
     /* Apply all transitions with the trigger r.  */
-    for(set<application>::iterator ii=s_mid->begin(); ii!=s_mid->end(); ++ii)
-      for(int j=q[ii->q].t.size()-1; j>=0; j--)
-        if(q[ii->q].t[j]->trigger_set().contains(r)) {
-          vector<string> u = q[ii->q].t[j]->all_outcomes(r); 
-          for(int k=u.size()-1; k>=0; k--) {
-            vector<string> w(ii->y);
-            if (u[k] != "0")
-              w.push_back(u[k]);
-            s_new->insert(application(w, q[ii->q].t[j]->d));
-          }
-        }
+    step(s_mid, (*x)[i], s_new, o);
+    if (st)
+      st->count(s_new);
 
-    //printf("after nonzeros:");
-    //for(set<application>::iterator ii=s_new->begin(); ii!=s_new->end(); ++ii) {
-    //  printf(" ");
-    //  ii->display();
-    //}
-    //printf("\n");
-
-    set<application> *s_tmp;
+    frontier *s_tmp;
     s_old->clear(); s_mid->clear();
     s_tmp = s_old; s_old = s_new; s_new = s_tmp;
   }
 
-  set<vector<string> > *s = new set<vector<string> >;
-  for(set<application>::iterator ii=s_mid->begin(); ii!=s_mid->end(); ++ii)
-    if (q[ii->q].accept) {
-      vector<string> v = ii->y;
-      if (reflect)
-        reverse(v.begin(), v.end());
-      s->insert(v);      
+  form_set *r = accepted(s_mid, o, reflect);
+  if (lazy) {
+    if (lazy->conflict) {
+      delete r;
+      r = NULL;
     }
-      
-  return s; 
+    pthread_mutex_unlock(&lazy->lock);
+  }
+  return r;
 }
 
+/* Transduce each of the strings x[j], putting the results in r[j].  The
+   strings are taken in sorted order, which is a walk over the trie of them:
+   mid[k] holds what transduce() calls s_mid after k phones of the current
+   string, and a string only has to be read on from where it parts from
+   the one before.  If reflect is set the strings are read backwards, so
+   it's their reversals that get sorted.  A sequential automaton has no
+   sets of applications to share, so there it's a string at a time.  */
+void automaton::transduce_sorted(const vector<vector<int> > &x0, vector<form_set *> &r, int max_epen, bool reflect,
+                                 transduce_stats *st) {
+  if (sequential()) {
+    vector<int> y;
+    r.resize(x0.size());
+    for(int j=0; j<x0.size(); j++) {
+      r[j] = new form_set;
+      if (transduce_sequential(x0[j], y, reflect))
+        r[j]->insert(y);
+    }
+    return;
+  }
 
-
-
+  vector<vector<int> > rx;
+  if (reflect) {
+    rx = x0;
+    for(int j=0; j<rx.size(); j++)
+      reverse(rx[j].begin(), rx[j].end());
+  }
+  const vector<vector<int> > &x = reflect ? rx : x0;
+  vector<int> order(x.size());
+  for(int j=0; j<x.size(); j++)
+    order[j] = j;
+  sort(order.begin(), order.end(), index_less(x));
+  r.resize(x.size());
+
+  if (lazy)
+    pthread_mutex_lock(&lazy->lock);
+  out_arena o;
+  zero_search z;
+  deque<frontier> mid(1);
+  frontier s;
+  s.insert(q0, 0);
+  close_zeros(&s, &mid[0], o, z, max_epen, st);
+
+  const vector<int> *prev = NULL;
+  for(int j=0; j<order.size(); j++) {
+    const vector<int> &v = x[order[j]];
+    int k = 0;
+    if (prev)
+      for(; k<v.size() && k<prev->size() && v[k] == (*prev)[k]; k++);
+    for(; k<v.size(); k++) {
+      s.clear();
+      step(&mid[k], v[k], &s, o);
+      if (st)
+        st->count(&s);
+      if (mid.size() == k+1)
+        mid.push_back(frontier());
+      mid[k+1].clear();
+      close_zeros(&s, &mid[k+1], o, z, max_epen, st);
+    }
+    r[order[j]] = accepted(&mid[v.size()], o, reflect);
+    if (lazy && lazy->conflict) {
+      delete r[order[j]];
+      r[order[j]] = NULL;
+    }
+    prev = &v;
+  }
+  if (lazy)
+    pthread_mutex_unlock(&lazy->lock);
+}
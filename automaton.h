@@ -2,6 +2,8 @@
 #define __RSCA_AUTOMATON
 
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <vector>
 #include <deque>
 #include <map>
@@ -10,6 +12,7 @@
 #include <algorithm>
 
 #include "forfc.h"
+#include "phones.h"
 
 using namespace std;
 
@@ -30,23 +33,23 @@ struct transition {
   virtual void display() = 0;
   /* either which strings trigger this transition or its complement, whichever
      is finite */
-  virtual forfc<string> trigger_set() = 0;
+  virtual forfc<int> trigger_set() = 0;
   /* the next two are only correct if t is known to be a trigger */
-  virtual string outcome(string t) = 0;
-  virtual vector<string> all_outcomes(string t) = 0;
-  virtual transition *forselect(string &t) = 0;
+  virtual int outcome(int t) = 0;
+  virtual vector<int> all_outcomes(int t) = 0;
+  virtual transition *forselect(int t) = 0;
 
   virtual ~transition() {}
 };
 
 struct pos_transition : transition {
-  vector<string> x;
-  vector<string> y;
+  vector<int> x;
+  vector<int> y;
 
-  pos_transition(vector<string> x_, vector<string> y_) : x(x_), y(y_) { sgd = -1; }
-  pos_transition(string x0, string y0) {
-    x = vector<string>(1);
-    y = vector<string>(1);
+  pos_transition(vector<int> x_, vector<int> y_) : x(x_), y(y_) { sgd = -1; }
+  pos_transition(int x0, int y0) {
+    x = vector<int>(1);
+    y = vector<int>(1);
     x[0] = x0;
     y[0] = y0;
     sgd = -1;
@@ -57,34 +60,34 @@ struct pos_transition : transition {
     if (sgd != -1)
       printf("[%d] ", sgd);
     for(int i = x.size()-1; i >= 0; i--)
-      printf("%s/%s ", x[i].c_str(), y[i].c_str());
+      printf("%s/%s ", phone_name[x[i]].c_str(), phone_name[y[i]].c_str());
     printf("-> %d", d);
   }
-  forfc<string> trigger_set() { return forfc<string>(x, true); }
-  string outcome(string t) {
+  forfc<int> trigger_set() { return forfc<int>(x, true); }
+  int outcome(int t) {
     for(int i=x.size()-1; i>=0; i--)
       if(x[i]==t)
         return y[i];
-    return ""; // an invalid case
+    return -1; // an invalid case
   }
-  vector<string> all_outcomes(string t) {
-    vector<string> v;
+  vector<int> all_outcomes(int t) {
+    vector<int> v;
     for(int i=0; i<x.size(); i++)
       if(x[i]==t)
         v.push_back(y[i]);
     return v;
   }
-  transition *forselect(string &t) { return new pos_transition(t, outcome(t)); }
+  transition *forselect(int t) { return new pos_transition(t, outcome(t)); }
     
   ~pos_transition() {}
 };
 
 struct cst_transition : transition {
-  vector<string> x;
+  vector<int> x;
 
-  cst_transition(vector<string> x_) : x(x_) { sgd = -1; }
-  cst_transition(string x0) {
-    x = vector<string>(1);
+  cst_transition(vector<int> x_) : x(x_) { sgd = -1; }
+  cst_transition(int x0) {
+    x = vector<int>(1);
     x[0] = x0;
     sgd = -1; 
   }
@@ -94,58 +97,58 @@ struct cst_transition : transition {
     if (sgd != -1)
       printf("[%d] ", sgd);
     for(int i = x.size()-1; i >= 0; i--)
-      printf("%s ", x[i].c_str());
+      printf("%s ", phone_name[x[i]].c_str());
     printf("-> %d", d);
   }
-  forfc<string> trigger_set() { return forfc<string>(x, true); }
-  string outcome(string t) { return t; }
-  vector<string> all_outcomes(string t) { return vector<string>(1, t); }
-  transition *forselect(string &t) { return new cst_transition(t); }
+  forfc<int> trigger_set() { return forfc<int>(x, true); }
+  int outcome(int t) { return t; }
+  vector<int> all_outcomes(int t) { return vector<int>(1, t); }
+  transition *forselect(int t) { return new cst_transition(t); }
 
   ~cst_transition() {}
 };
 
 struct neg_transition : transition {
-  vector<string> z;
+  vector<int> z;
 
-  neg_transition(vector<string> z_) : z(z_) { sgd = -1; }
+  neg_transition(vector<int> z_) : z(z_) { sgd = -1; }
 
   int kind() { return NEG_TR; }
   void display() {
     if (sgd != -1)
       printf("[%d] ", sgd);
     for(int i = z.size()-1; i >= 0; i--)
-      printf("^%s ", z[i].c_str());
+      printf("^%s ", phone_name[z[i]].c_str());
     printf("-> %d", d);
     sgd = -1;
   }
-  forfc<string> trigger_set() { return forfc<string>(z, false); }
-  string outcome(string t) { return t; }
-  vector<string> all_outcomes(string t) { return vector<string>(1, t); }
-  transition *forselect(string &t) { return new cst_transition(t); }
+  forfc<int> trigger_set() { return forfc<int>(z, false); }
+  int outcome(int t) { return t; }
+  vector<int> all_outcomes(int t) { return vector<int>(1, t); }
+  transition *forselect(int t) { return new cst_transition(t); }
 
   ~neg_transition() {}
 };
 
 struct ner_transition : transition {
-  vector<string> z;
-  string s;
+  vector<int> z;
+  int s;
 
-  ner_transition(vector<string> z_, string s_ = "0") : z(z_), s(s_) { sgd = -1; }
+  ner_transition(vector<int> z_, int s_ = ZERO_PH) : z(z_), s(s_) { sgd = -1; }
 
   int kind() { return NER_TR; }
   void display() {
     if (sgd != -1)
       printf("[%d] ", sgd);
     for(int i = z.size()-1; i >= 0; i--)
-      printf("^%s/%s ", z[i].c_str(), s.c_str());
+      printf("^%s/%s ", phone_name[z[i]].c_str(), phone_name[s].c_str());
     printf("-> %d", d);
     sgd = -1;
   }
-  forfc<string> trigger_set() { return forfc<string>(z, false); }
-  string outcome(string t) { return s; }
-  vector<string> all_outcomes(string t) { return vector<string>(1, s); }
-  transition *forselect(string &t) { return new pos_transition(t, s); }
+  forfc<int> trigger_set() { return forfc<int>(z, false); }
+  int outcome(int t) { return s; }
+  vector<int> all_outcomes(int t) { return vector<int>(1, s); }
+  transition *forselect(int t) { return new pos_transition(t, s); }
 
   ~ner_transition() {}
 };
@@ -155,13 +158,13 @@ struct splitting_transition : transition {
   int bun; // which transition the split of this one is conditioned to
 
   /* we don't need these */
-  forfc<string> trigger_set() { return forfc<string>(vector<string>(), true); }
-  string outcome(string t) { return ""; }
-  vector<string> all_outcomes(string t) { return vector<string>(); }
-  transition *forselect(string &t) { return select(t); } // I dunno about this one.
+  forfc<int> trigger_set() { return forfc<int>(vector<int>(), true); }
+  int outcome(int t) { return -1; }
+  vector<int> all_outcomes(int t) { return vector<int>(); }
+  transition *forselect(int t) { return select(t); } // I dunno about this one.
   
   /* reduce this to the most similar kind of non-split transition, for phone s */
-  virtual transition *select(string &s) = 0; 
+  virtual transition *select(int s) = 0; 
   virtual ~splitting_transition() {}
 };
 
@@ -174,35 +177,35 @@ struct spl_transition : splitting_transition {
       printf("[%d] ", sgd);
     printf("#%d \"%s\" -> %d", bun, h.c_str(), d);
   }
-  transition *select(string &s) { return new cst_transition(s); }
+  transition *select(int s) { return new cst_transition(s); }
   
   ~spl_transition() {}
 };
 
 struct rspl_transition : splitting_transition {
-  string e;
-  rspl_transition(string h_, int bun_, string e_ = "0") : e(e_) { h = h_; bun = bun_; sgd = -1; }
+  int e;
+  rspl_transition(string h_, int bun_, int e_ = ZERO_PH) : e(e_) { h = h_; bun = bun_; sgd = -1; }
 
   int kind() { return RSPL_TR; }
   void display() {
     if (sgd != -1)
       printf("[%d] ", sgd);
-    printf("#%d \"%s\"/%s -> %d", bun, h.c_str(), e.c_str(), d);
+    printf("#%d \"%s\"/%s -> %d", bun, h.c_str(), phone_name[e].c_str(), d);
   }
-  transition *select(string &s) { return new pos_transition(s, e); }
+  transition *select(int s) { return new pos_transition(s, e); }
 
   ~rspl_transition() {}
 };
 
 struct drspl_transition : splitting_transition {
-  string e;
-  drspl_transition(string h_, int bun_, string e_ = "0") : e(e_) { h = h_; bun = bun_; sgd = -1; }
+  int e;
+  drspl_transition(string h_, int bun_, int e_ = ZERO_PH) : e(e_) { h = h_; bun = bun_; sgd = -1; }
 
   int kind() { return DRSPL_TR; }
   void display() {
-    printf("#%d %s/\"%s\" -> %d", bun, e.c_str(), h.c_str(), d);
+    printf("#%d %s/\"%s\" -> %d", bun, phone_name[e].c_str(), h.c_str(), d);
   }
-  transition *select(string &s) { return new pos_transition(e, s); }
+  transition *select(int s) { return new pos_transition(e, s); }
 
   ~drspl_transition() {}
 };
@@ -211,26 +214,227 @@ struct drspl_transition : splitting_transition {
 
 
 
-/* A partial application of an automaton to a string.  */
-struct application {
-  vector<string> y;
-  int q;
+/* Sets of strings of phones, e.g. the outcomes of a sound change, and the
+   sets of states-with-pending-output that the determinisation works with.
+   Both are ordered as if the phones were still strings.  */
+typedef set<vector<int>, form_less> form_set;
+typedef set<pair<int, vector<int> >, reach_less> reach_set;
 
-  application(vector<string> y_, int q_) : y(y_), q(q_) {}
-  bool operator<(const application &a) const {
-    if (y != a.y)
-      return y < a.y;
-    return q < a.q;
+/* For sorting indices into a vector of strings by the strings.  */
+struct index_less {
+  const vector<vector<int> > &x;
+
+  index_less(const vector<vector<int> > &x_) : x(x_) {}
+  bool operator()(int i, int j) const { return x[i] < x[j]; }
+};
+
+/* The outputs of partial applications of an automaton.  Each output is a
+   node of a trie of all the outputs made since the arena was cleared (a
+   phone on the end of its parent's output), and nodes are hash-consed, so
+   equal outputs are the same node.  Extending an output is then a single
+   lookup, nothing is copied, and nothing is freed until the word is done.
+   Node 0 is the empty output.  */
+static inline size_t mix(uint64_t k) {
+  k *= 0x9e3779b97f4a7c15ULL;
+  return k ^ (k >> 29);
+}
+
+struct out_arena {
+  vector<int> parent, phone;
+  vector<int> slot; // an open-addressed table of nodes, -1 where empty
+
+  out_arena() : parent(1, -1), phone(1, -1), slot(64, -1) {}
+
+  int extend(int n, int r) {
+    if (2 * parent.size() > slot.size())
+      grow();
+    size_t m = slot.size() - 1;
+    for(size_t i=mix(((uint64_t)n << 32) | (unsigned)r) & m; ; i=(i+1) & m) {
+      int k = slot[i];
+      if (k == -1) {
+        slot[i] = parent.size();
+        parent.push_back(n);
+        phone.push_back(r);
+        return slot[i];
+      }
+      if (parent[k] == n && phone[k] == r)
+        return k;
+    }
   }
-  void display() const {
-    printf("[%d]", q);
-    for(int i=0; i<y.size(); i++)
-      printf(" %s", y[i].c_str());
+  void grow();
+  void spell(int n, vector<int> &v) const;
+};
+
+/* A set of partial applications, as (state, output node) pairs in the
+   order they were added.  Membership is by a hash table whose slots are
+   stamped with a generation, so clearing it doesn't mean wiping it.  */
+struct frontier {
+  vector<pair<int, int> > a;
+  vector<uint64_t> key;
+  vector<unsigned> stamp;
+  unsigned gen;
+
+  frontier() : key(16), stamp(16, 0), gen(1) {}
+
+  void clear() {
+    a.clear();
+    if (++gen == 0) {
+      fill(stamp.begin(), stamp.end(), 0);
+      gen = 1;
+    }
+  }
+  bool insert(int q, int n) {
+    if (2 * (a.size() + 1) > key.size())
+      grow();
+    uint64_t k = ((uint64_t)q << 32) | (unsigned)n;
+    size_t m = key.size() - 1;
+    for(size_t i=mix(k) & m; ; i=(i+1) & m) {
+      if (stamp[i] != gen) {
+        stamp[i] = gen;
+        key[i] = k;
+        a.push_back(pair<int, int>(q, n));
+        return true;
+      }
+      if (key[i] == k)
+        return false;
+    }
+  }
+  void grow();
+};
+
+
+
+/* The state of apply_zeros()'s walk along zero moves.  The walk goes
+   depth first with a stack of its own, and d[q] counts the visits to q on
+   the path it's on, going back down as it backs up, so nothing needs
+   copying; h is a hash of d, the sum of mix(q)|1 over the visits.  What's
+   reachable from an application depends on nothing more than its state,
+   output and d, so each (state, output, d) is remembered in seen and the
+   same place isn't searched from twice: paths that differ only in order,
+   or in going round loops that output nothing, come together there.  h
+   only narrows the search; d itself is kept too, as the sorted states
+   of the path in prof, and compared by same() before anything's pruned.
+   One of these lasts a whole transduction, with seen cleared for each
+   frontier (the same state and output can turn up again after a phone's
+   deleted).  */
+struct zero_frame {
+  int q, n; // an application on the path
+  int k, end; // the zero moves of q still to take
+};
+
+struct zero_search {
+  vector<int> d;
+  uint64_t h;
+  vector<zero_frame> path;
+  vector<uint64_t> key, hash; // seen, open-addressed
+  vector<size_t> at; // where each one's d starts in prof
+  vector<unsigned> stamp;
+  unsigned gen;
+  size_t used;
+  vector<int> prof;
+
+  zero_search() : h(0), key(16), hash(16), at(16), stamp(16, 0), gen(1), used(0) {}
+
+  void clear() {
+    if (++gen == 0) {
+      fill(stamp.begin(), stamp.end(), 0);
+      gen = 1;
+    }
+    used = 0;
+    prof.clear();
+  }
+  bool see(int q, int n) {
+    if (2 * (used + 1) > key.size())
+      grow();
+    uint64_t k = ((uint64_t)q << 32) | (unsigned)n;
+    size_t m = key.size() - 1;
+    for(size_t i=mix(k ^ h) & m; ; i=(i+1) & m) {
+      if (stamp[i] != gen) {
+        stamp[i] = gen;
+        key[i] = k;
+        hash[i] = h;
+        at[i] = remember(q);
+        used++;
+        return true;
+      }
+      if (key[i] == k && hash[i] == h && same(at[i], q))
+        return false;
+    }
+  }
+  size_t remember(int q);
+  bool same(size_t a, int q) const;
+  void grow();
+};
+
+/* What a transduction cost, counted if it's asked for (see -P).  */
+struct transduce_stats {
+  unsigned long entries; // applications put in frontiers
+  unsigned long peak; // the most in any one frontier
+  unsigned long zero_calls; // applications apply_zeros() searched from
+
+  transduce_stats() : entries(0), peak(0), zero_calls(0) {}
+  void count(const frontier *s) {
+    entries += s->a.size();
+    if (s->a.size() > peak)
+      peak = s->a.size();
   }
 };
 
 
 
+/* The sets of states of the old automaton that determinise() makes
+   states of the new one from.  Each is interned once, as a sorted vector,
+   in an open-addressed table; from then on it's known by its index, and
+   state[] says which new state it became.  */
+struct state_sets {
+  vector<vector<int> > sets;
+  vector<int> state;
+  vector<int> slot; // indices into sets, -1 where empty
+
+  state_sets() : slot(64, -1) {}
+
+  int intern(const vector<int> &v, int m, bool *added);
+  void grow();
+};
+
+struct automaton;
+
+/* The subset construction of determinise() part way through: what it
+   needs to go on making states of the new automaton b out of sets of
+   states of the old one.  queue holds the sets not yet made into
+   states with transitions, by their index in label.  */
+struct subset_construction {
+  automaton *b;
+  int n, m;
+  state_sets label;
+  deque<int> queue;
+  vector<vector<forfc<int> > > trig;
+  vector<reach_set> zero_closure, zero_closure_breaking;
+  bool not_sporadic, respecting_conflicts;
+};
+
+/* For -L: what a lazily determinised automaton needs to go on making its
+   states.  a is the automaton it's being made from; flat says where each
+   of the states made so far is in the flat table (or -1), and set which
+   set in c.label each is still to be made from (or -1).  The states are
+   made by whichever transduce() first reaches them, so lock is held for
+   the whole of a transduction.  */
+struct lazy_states {
+  automaton *a;
+  subset_construction c;
+  vector<int> flat, set;
+  bool conflict; // some state was ambiguous
+  pthread_mutex_t lock;
+};
+
+/* A transition triggered by zero, as zero_close() needs it: a cst one
+   if pos is false, else a pos one with these outcomes for zero.  */
+struct zero_edge {
+  int d;
+  bool pos;
+  vector<int> out;
+};
+
 struct automaton_state {
   bool accept; // accepting?
   vector<transition *> t; // transitions out
@@ -245,16 +449,98 @@ struct automaton_state {
 };
 
 
+/* The form of a finished automaton that transduce() actually walks.
+   The transition objects above are convenient to build and rebuild,
+   but asking one of them whether it's triggered by a phone means a
+   virtual call and a freshly copied forfc.  Here all the transitions of
+   state i are laid out consecutively, from t[first[i]] to t[first[i+1]-1],
+   and each names a run [lo, hi) of the phone pools x and y.  */
+struct flat_transition {
+  int d; // destination state, or in a lazy automaton -1-s for state s of q not made yet
+  bool pos; // true if x[lo..hi) are the triggers, false if they're the exceptions
+  int lo, hi;
+  /* For pos transitions y[k] is the outcome of x[k], and the run is sorted
+     on x.  For the others this is the outcome, or -1 if it's the trigger.  */
+  int out;
+};
+
+/* Indexes over the transitions, made by index() so that transduce()
+   needn't search through them: each is a list of moves, a transition
+   (named rather than its destination, which a lazy automaton may not
+   have made yet) and what it outputs.
+   - The moves of state i on zero, which are all apply_zeros() cares
+     about, are z[zfirst[i]] to z[zfirst[i+1]-1].
+   - Each phone that some transition of state i mentions, as a trigger or
+     an exception, is a key of i, key[kfirst[i]] to key[kfirst[i+1]-1],
+     and the moves of i on key[k] are m[rfirst[k]] to m[rfirst[k+1]-1].
+     find(i, r) gives the k for r, or -1 if i doesn't mention r; it looks
+     in dense, a row of width entries per state, unless that would be too
+     big, and then in an open-addressed table.  Zero is a key like
+     any other, for when the word itself has one.
+   - Any other phone only triggers the negative transitions, and those
+     moves are o[ofirst[i]] to o[ofirst[i+1]-1]; there an output of -1
+     means the phone itself.
+   sequential says that no state has moves on zero, or more than one
+   move on any phone: then there's only ever one way through, and
+   transduce_sequential() can take it.  */
+struct flat_move {
+  int j; // the transition
+  int y; // its output
+};
+
+struct flat_table {
+  vector<int> first;
+  vector<flat_transition> t;
+  vector<int> x, y;
+  vector<char> accept;
+
+  vector<int> zfirst;
+  vector<flat_move> z;
+  vector<int> kfirst, key, rfirst;
+  vector<flat_move> m;
+  vector<int> ofirst;
+  vector<flat_move> o;
+
+  bool sequential;
+  bool hashed;
+  int width;
+  vector<int> dense;
+  vector<uint64_t> hkey; // ~0 where empty
+  vector<int> hval;
+  size_t hused;
+
+  flat_table() : sequential(true), hashed(false), width(0), hused(0) {}
+
+  void index();
+  void place(int i);
+  void grow();
+
+  int find(int i, int r) const {
+    if (!hashed)
+      return r < width ? dense[(size_t)i * width + r] : -1;
+    uint64_t k = ((uint64_t)i << 32) | (unsigned)r;
+    size_t n = hkey.size() - 1;
+    for(size_t l=mix(k) & n; ; l=(l+1) & n) {
+      if (hkey[l] == k)
+        return hval[l];
+      if (hkey[l] == ~0ULL)
+        return -1;
+    }
+  }
+};
+
 struct automaton {
   int q0, q1; // start and end states
   int mq0, mq1; // if another automaton was merged in, its start and end states
   vector<automaton_state> q; // states
+  flat_table f; // made by compile(), and used from then on by transduce()
+  lazy_states *lazy; // if f is still being made, by determinise_lazily()
   
   automaton(int n = 0);
   automaton(transition *t);
   automaton(char *x, char *y = NULL);
-  automaton(vector<string> *cat, bool p, int group = -1);
-  automaton(vector<string> *cat0, vector<string> *cat1);
+  automaton(vector<int> *cat, bool p, int group = -1);
+  automaton(vector<int> *cat0, vector<int> *cat1);
 
   void free_transitions();
   
@@ -274,16 +560,33 @@ struct automaton {
 
   void display();
   
-  void zero_close(set<pair<int, vector<string> > > *s, int k, vector<string> &output,
-                  bool catch_form1, int n = -1);
-  int get_or_create_determination(set<int> &t0, map<set<int>, int> &label,
-                                  int &m, deque<set<int> > &queue, int n);
-  int zero_reach(set<pair<int,vector<string> > > &g, vector<set<pair<int, vector<string> > > > &zero_closure,
-                 bool not_sporadic, map<set<int>, int> &label, int &m, deque<set<int> > &queue, int aq1, int n);
+  void zero_close(reach_set *s, int k, bool catch_form1, const vector<vector<zero_edge> > &zeros,
+                  vector<int> &seen, int stamp, int n);
+  int get_or_create_determination(const set<int> &t0, state_sets &label,
+                                  int &m, deque<int> &queue, int n);
+  int zero_reach(reach_set &g, vector<reach_set> &zero_closure, vector<reach_set> &zero_closure_breaking,
+                 bool not_sporadic, state_sets &label, int &m, deque<int> &queue, int aq1, int n);
+  void start_determinise(subset_construction &c, bool not_sporadic, int initial_form, bool respecting_conflicts);
+  bool determine_state(subset_construction &c, int k);
+  void drop_zero_loops(int i);
   automaton *determinise(bool not_sporadic = true, int initial_form = 0, bool respecting_conflicts = true);
 
-  void apply_zeros(const application *a, set<application> *s, vector<int> &c, int max_epen);
-  set<vector<string> > *transduce(vector<string> *x, int max_epen = 1, bool reflect = false);
+  automaton *determinise_lazily(bool not_sporadic, int initial_form, bool respecting_conflicts);
+  int materialise(int x);
+  int resolve(int j);
+
+  void compile();
+  void flatten(int i);
+  void minimise();
+  void apply_zeros(int q, int n, out_arena &o, frontier *s, zero_search &z, int max_epen, transduce_stats *st);
+  void close_zeros(const frontier *s, frontier *t, out_arena &o, zero_search &z, int max_epen, transduce_stats *st);
+  void step(const frontier *s, int r, frontier *t, out_arena &o);
+  bool sequential() const { return lazy == NULL && f.sequential; }
+  bool transduce_sequential(const vector<int> &x, vector<int> &y, bool reflect);
+  form_set *accepted(const frontier *s, const out_arena &o, bool reflect);
+  form_set *transduce(vector<int> *x, int max_epen = 1, bool reflect = false, transduce_stats *st = NULL);
+  void transduce_sorted(const vector<vector<int> > &x, vector<form_set *> &r, int max_epen = 1, bool reflect = false,
+                        transduce_stats *st = NULL);
 };
 
 #endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "automaton.h"
+#include "soundchange.h"
+#include "profile.h"
+
+/* A harness for timing rsca, built by "make bench".  For each rule file
+   (those given, plus some synthetic ones made to stress particular
+   things) and each direction, a child process parses the file, makes up
+   a lexicon from the phones it defines, and runs the lexicon through
+   apply_changes().  Each such run gives one line of JSON on stdout: the
+   parse time, the build time and size of each change, and the words per
+   second.  Running each in its own process keeps the parser's globals
+   from piling up, and lets a run that takes too long be killed.  */
+
+/* from apply.cc, which is built with its main() renamed for us */
+extern char *filename;
+extern bool reverse_changes;
+extern bool complaint;
+extern FILE *yyin;
+extern int yyparse();
+extern void apply_changes();
+extern vector<int> *tokenise(const char *s, int n, bool *unknown = NULL);
+extern vector<automaton *> changes;
+extern vector<change_parameters *> change_stuff;
+extern map<string, vector<int>*> category;
+
+int words = 2000, reverse_words = 20, seed = 1, time_limit = 120;
+
+
+
+/* The synthetic rule files.  */
+
+static string stress_undelete() {
+  string s = "V = aeiou\nC = ptkbdgmnslr\n\n";
+  for(int n=2; n<=8; n+=2) {
+    char b[64];
+    snprintf(b, sizeof(b), "[undelete %d\n0 e [C]__[C]\n\n", n);
+    s += b;
+  }
+  s += "e 0 [V][C]__[C][V]\n";
+  return s;
+}
+
+static string stress_strands() {
+  const char *c = "ptkbdgmnslrfvz";
+  string s = "V = aeiou\nC = ptkbdgmnslrfvz\n\n";
+  int n = strlen(c);
+  for(int round=0; round<3; round++) {
+    for(int i=0; i<n; i++) {
+      s += c[i];
+      s += " ";
+      s += c[(i + round + 1) % n];
+      s += i == n-1 ? " [V]__[V]\n\n" : " [V]__[V] //\n";
+    }
+  }
+  return s;
+}
+
+/* Big categories, out of phones made with a modifier.  */
+static string stress_categories() {
+  const char *mods = "ABCDEFGHIJ", *base = "ptkbdgmnslrfvz";
+  string s = "mod10 ABCDEFGHIJ\nV = aeiou\nC = ptkbdgmnslrfvz\n";
+  string k1 = "K1 =", k2 = "K2 =";
+  for(int i=0; mods[i]; i++)
+    for(int j=0; base[j]; j++) {
+      (k1 += " ") += base[j];
+      k1 += mods[i];
+      (k2 += " ") += base[(j+1) % 14];
+      k2 += mods[(i+1) % 10];
+    }
+  s += k1 + "\n" + k2 + "\n\n";
+  s += "[K1] [K2] [V]__[V]\n";
+  s += "[K2] [K1] [C]__\n";
+  s += "[K1] 0 __#\n";
+  return s;
+}
+
+
+
+/* Make up a word.  If the rule file has categories V and C we make it of
+   syllables like a word might be; otherwise it's any old phones.  */
+static string make_word(const vector<int> &v, const vector<int> &c, const vector<int> &all) {
+  string w;
+  if (!v.empty() && !c.empty()) {
+    for(int n=1 + rand() % 3; n>0; n--) {
+      if (rand() % 4)
+        w += phone_name[c[rand() % c.size()]];
+      w += phone_name[v[rand() % v.size()]];
+      if (rand() % 3 == 0)
+        w += phone_name[c[rand() % c.size()]];
+    }
+  }
+  else
+    for(int n=2 + rand() % 6; n>0; n--)
+      w += phone_name[all[rand() % all.size()]];
+  return w;
+}
+
+/* Only phones that tokenise back to themselves are any good.  */
+static vector<int> usable(const vector<int> &v) {
+  vector<int> u;
+  for(int i=0; i<v.size(); i++) {
+    if (v[i] == ZERO_PH || v[i] == BOUND_PH || v[i] == OTHER_PH)
+      continue;
+    vector<int> *x = tokenise(phone_name[v[i]].data(), phone_name[v[i]].size());
+    if (x && x->size() == 3 && (*x)[1] == v[i])
+      u.push_back(v[i]);
+    delete x;
+  }
+  return u;
+}
+
+static vector<int> category_phones(const char *name) {
+  map<string, vector<int>*>::iterator ii = category.find(name);
+  return ii == category.end() ? vector<int>() : usable(*ii->second);
+}
+
+/* The child's side of a run: everything goes into out, which becomes the
+   JSON fields after the file and direction.  */
+static void run(const char *file, bool reverse, int n, int fd) {
+  filename = strdup(file);
+  reverse_changes = reverse;
+  complaint = false;
+  if (NULL == (yyin = fopen(filename, "r")))
+    exit(1);
+
+  double t0 = now();
+  yyparse();
+  double parse = now() - t0;
+
+  string out;
+  char b[256];
+  snprintf(b, sizeof(b), ", \"parse_seconds\": %.6f, \"changes\": [", parse);
+  out += b;
+  for(int i=0; i<changes.size(); i++) {
+    snprintf(b, sizeof(b), "%s{\"name\": ", i ? ", " : "");
+    out += b + json_string(change_stuff[i]->name);
+    snprintf(b, sizeof(b), ", \"build_seconds\": %.6f, \"states\": %d, \"transitions\": %d}",
+             change_stuff[i]->build_time, (int)changes[i]->f.accept.size(), (int)changes[i]->f.t.size());
+    out += b;
+  }
+  out += "]";
+
+  /* The lexicon.  */
+  srand(seed);
+  vector<int> all(phone_name.size());
+  for(int i=0; i<all.size(); i++)
+    all[i] = i;
+  all = usable(all);
+  vector<int> v = category_phones("V"), c = category_phones("C");
+  char lexicon[] = "/tmp/rsca-bench-lexicon-XXXXXX";
+  int lfd = mkstemp(lexicon);
+  FILE *f = fdopen(lfd, "w");
+  for(int i=0; i<n && !all.empty(); i++)
+    fprintf(f, "%s\n", make_word(v, c, all).c_str());
+  fclose(f);
+
+  freopen(lexicon, "r", stdin);
+  freopen("/dev/null", "w", stdout);
+  t0 = now();
+  apply_changes();
+  double apply = now() - t0;
+  unlink(lexicon);
+
+  snprintf(b, sizeof(b), ", \"words\": %d, \"apply_seconds\": %.6f, \"words_per_second\": %.1f",
+           n, apply, apply > 0 ? n / apply : 0.0);
+  out += b;
+  write(fd, out.data(), out.size());
+  exit(0);
+}
+
+/* Run one configuration in a child, and print its line.  */
+static void bench(const char *file, const char *label, bool reverse) {
+  int p[2];
+  fflush(stdout);
+  if (pipe(p))
+    return;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(p[0]);
+    alarm(time_limit);
+    run(file, reverse, reverse ? reverse_words : words, p[1]);
+  }
+  close(p[1]);
+  string out;
+  char b[4096];
+  for(int k; (k = read(p[0], b, sizeof(b))) > 0; )
+    out.append(b, k);
+  close(p[0]);
+  int status;
+  waitpid(pid, &status, 0);
+
+  printf("{\"file\": %s, \"direction\": \"%s\"", json_string(label).c_str(),
+         reverse ? "reverse" : "forward");
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    printf("%s}\n", out.c_str());
+  else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+    printf(", \"error\": \"took more than %d seconds\"}\n", time_limit);
+  else
+    printf(", \"error\": \"failed\"}\n");
+}
+
+int main(int argc, char **argv) {
+  vector<const char *> files;
+  bool stress = true;
+  for(int i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "-n") && i < argc-1)
+      words = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i < argc-1)
+      reverse_words = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i < argc-1)
+      seed = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-t") && i < argc-1)
+      time_limit = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-S"))
+      stress = false;
+    else if (argv[i][0] == '-') {
+      fprintf(stderr, "usage: %s [-n words] [-r reverse words] [-s seed] [-t seconds] [-S] [rule files]\n", argv[0]);
+      fprintf(stderr, "-S leaves out the synthetic rule files\n");
+      exit(1);
+    }
+    else
+      files.push_back(argv[i]);
+  }
+
+  for(int i=0; i<files.size(); i++) {
+    bench(files[i], files[i], false);
+    bench(files[i], files[i], true);
+  }
+
+  if (stress) {
+    const char *name[] = {"stress:undelete", "stress:strands", "stress:categories"};
+    string text[] = {stress_undelete(), stress_strands(), stress_categories()};
+    for(int i=0; i<3; i++) {
+      char file[] = "/tmp/rsca-bench-rules-XXXXXX";
+      int fd = mkstemp(file);
+      write(fd, text[i].data(), text[i].size());
+      close(fd);
+      bench(file, name[i], false);
+      bench(file, name[i], true);
+      unlink(file);
+    }
+  }
+
+  return 0;
+}
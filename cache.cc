@@ -0,0 +1,267 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <set>
+
+#include "cache.h"
+#include "automaton.h"
+#include "soundchange.h"
+
+extern vector<automaton *> changes;
+extern vector<change_parameters *> change_stuff;
+
+/* Bump this whenever the layout below or the meaning of the automata
+   changes.  */
+static const uint32_t cache_version = 4;
+static const char cache_magic[4] = {'R', 'S', 'C', 'A'};
+
+/* FNV-1a over the contents of a file.  */
+uint64_t hash_file(const char *file, bool *ok) {
+  uint64_t h = 14695981039346656037ULL;
+  FILE *f = fopen(file, "rb");
+  *ok = (f != NULL);
+  if (!f)
+    return 0;
+  unsigned char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    for(size_t i=0; i<n; i++) {
+      h ^= buf[i];
+      h *= 1099511628211ULL;
+    }
+  fclose(f);
+  return h;
+}
+
+/* Where to keep a file of the given kind for the rule file file.  */
+string cache_name(const char *file, bool reverse, const char *kind) {
+  return string(file) + (reverse ? ".rev." : ".fwd.") + kind;
+}
+
+
+
+/* Writing.  */
+
+void put(FILE *f, const void *p, size_t n) {
+  fwrite(p, 1, n, f);
+}
+
+void put_int(FILE *f, int32_t x) {
+  put(f, &x, sizeof(x));
+}
+
+void put_string(FILE *f, const string &s) {
+  put_int(f, s.size());
+  put(f, s.data(), s.size());
+}
+
+/* Save the current state of things.  We write to a temporary file and
+   rename it, so that a concurrent run never sees half a cache.  */
+bool save_cache(const char *cfile, uint64_t key, bool reverse) {
+  string tmp = string(cfile) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f)
+    return false;
+
+  put(f, cache_magic, 4);
+  put_int(f, cache_version);
+  put(f, &key, sizeof(key));
+  put_int(f, reverse);
+
+  put(f, modtype, sizeof(int) * 256);
+  put_int(f, wide_modtype.size());
+  for(map<string, int>::iterator ii=wide_modtype.begin(); ii!=wide_modtype.end(); ++ii) {
+    put_string(f, ii->first);
+    put_int(f, ii->second);
+  }
+  put_int(f, phone_name.size());
+  for(int i=0; i<phone_name.size(); i++)
+    put_string(f, phone_name[i]);
+
+  put_int(f, changes.size());
+  for(int i=0; i<changes.size(); i++) {
+    change_parameters *c = change_stuff[i];
+    put_string(f, c->name);
+    put_int(f, c->max_epen);
+    put_int(f, c->not_sporadic);
+    put_int(f, c->respecting_conflicts);
+    put_int(f, c->reflect);
+
+    automaton *a = changes[i];
+    put_int(f, a->q0);
+    put_vector(f, a->f.first);
+    put_int(f, a->f.t.size());
+    for(int j=0; j<a->f.t.size(); j++) {
+      const flat_transition &t = a->f.t[j];
+      put_int(f, t.d);
+      put_int(f, t.pos);
+      put_int(f, t.lo);
+      put_int(f, t.hi);
+      put_int(f, t.out);
+    }
+    put_vector(f, a->f.x);
+    put_vector(f, a->f.y);
+    put_vector(f, a->f.accept);
+  }
+
+  bool ok = !ferror(f);
+  if (fclose(f) || !ok || rename(tmp.c_str(), cfile)) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+
+/* Reading.  */
+
+const char *map_file(const char *file, size_t *size) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return NULL;
+  *size = st.st_size;
+  return (const char *)m;
+}
+
+void unmap_file(const char *m, size_t size) {
+  munmap((void *)m, size);
+}
+
+/* Whether b's flat table makes sense with a phone table of the given
+   size: every state, transition and run it mentions is there, and every
+   phone is in the table.  index() and transduce() take all that on
+   trust, so a cache that's been mangled but still has the right key
+   mustn't get as far as them.  */
+static bool sane(const automaton *b, int phones) {
+  const flat_table &f = b->f;
+  int n = f.accept.size();
+  if (n == 0 || b->q0 < 0 || b->q0 >= n || f.first.size() != n + 1 || f.first[0] != 0 ||
+      f.first[n] != f.t.size() || f.x.size() != f.y.size())
+    return false;
+  for(int i=0; i<n; i++)
+    if (f.first[i] > f.first[i+1])
+      return false;
+  for(int j=0; j<f.t.size(); j++) {
+    const flat_transition &t = f.t[j];
+    if (t.d < 0 || t.d >= n || t.lo < 0 || t.lo > t.hi || t.hi > f.x.size() ||
+        t.out < -1 || t.out >= phones)
+      return false;
+    for(int k=t.lo; t.pos && k<t.hi; k++)
+      if (f.y[k] < 0)
+        return false;
+  }
+  for(int k=0; k<f.x.size(); k++)
+    if (f.x[k] < 0 || f.x[k] >= phones || f.y[k] < -1 || f.y[k] >= phones)
+      return false;
+  return true;
+}
+
+/* Try to load the cache.  Only if it's intact and matches key do we
+   touch any of the global state.  */
+bool load_cache(const char *cfile, uint64_t key, bool reverse) {
+  size_t size;
+  const char *m = map_file(cfile, &size);
+  if (m == NULL)
+    return false;
+
+  cursor c = {m, m + size, false};
+  char magic[4];
+  uint64_t k;
+  c.get(magic, 4);
+  bool ok = !memcmp(magic, cache_magic, 4) && c.get_int() == cache_version &&
+    c.get(&k, sizeof(k)) && k == key &&
+    c.get_int() == reverse;
+
+  int mt[256];
+  map<string, int> wmt;
+  vector<string> names;
+  vector<automaton *> a;
+  vector<change_parameters *> cp;
+  if (ok) {
+    c.get(mt, sizeof(mt));
+    for(int i=c.get_int(); i>0 && !c.bad; i--) {
+      string u = c.get_string();
+      wmt[u] = c.get_int();
+    }
+    for(int i=c.get_int(); i>0 && !c.bad; i--)
+      names.push_back(c.get_string());
+    for(int i=c.get_int(); i>0 && !c.bad; i--) {
+      change_parameters *p = new change_parameters();
+      p->name = c.get_string();
+      p->max_epen = c.get_int();
+      p->not_sporadic = c.get_int();
+      p->respecting_conflicts = c.get_int();
+      p->reflect = c.get_int();
+      cp.push_back(p);
+
+      automaton *b = new automaton(0);
+      b->q0 = b->q1 = c.get_int();
+      c.get_vector(b->f.first);
+      for(int j=c.get_int(); j>0 && !c.bad; j--) {
+        flat_transition t;
+        t.d = c.get_int();
+        int pos = c.get_int();
+        if (pos != 0 && pos != 1)
+          c.bad = true;
+        t.pos = pos;
+        t.lo = c.get_int();
+        t.hi = c.get_int();
+        t.out = c.get_int();
+        b->f.t.push_back(t);
+      }
+      c.get_vector(b->f.x);
+      c.get_vector(b->f.y);
+      c.get_vector(b->f.accept);
+      a.push_back(b);
+    }
+    ok = !c.bad && c.p == c.end;
+  }
+  unmap_file(m, size);
+
+  for(int i=0; ok && i<a.size(); i++)
+    ok = sane(a[i], names.size());
+
+  /* The phone table must come out with the same numbering; since ids
+     are handed out in order this holds unless something has already
+     been interned that the cache doesn't know about.  That's all made
+     sure of before anything is interned.  */
+  set<string> distinct(names.begin(), names.end());
+  ok = ok && distinct.size() == names.size() && names.size() >= 3 &&
+    names[ZERO_PH] == "0" && names[BOUND_PH] == "#" && names[OTHER_PH] == "*";
+  for(int i=0; ok && i<names.size(); i++) {
+    int k = find_phone(names[i].data(), names[i].size(), false);
+    ok = k == i || (k < 0 && i >= phone_name.size());
+  }
+
+  if (ok) {
+    for(int i=0; i<names.size(); i++)
+      intern(names[i]);
+    for(int i=0; i<a.size(); i++)
+      a[i]->f.index();
+  }
+
+  if (!ok) {
+    for(int i=a.size()-1; i>=0; i--) {
+      delete a[i];
+      delete cp[i];
+    }
+    return false;
+  }
+
+  memcpy(modtype, mt, sizeof(mt));
+  wide_modtype = wmt;
+  changes = a;
+  change_stuff = cp;
+  return true;
+}
@@ -0,0 +1,84 @@
+#ifndef __RSCA_CACHE
+#define __RSCA_CACHE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Compiled rule files.  Everything apply_changes() needs once parsing is
+   over (the compiled automata, their change_parameters, the phone table
+   and the modifier types) can be saved to a file next to the rule file
+   and loaded back instead of parsing and determinising again.  The
+   cache is keyed on a hash of the rule file's contents and the
+   direction, so a stale one is simply rebuilt.  */
+
+uint64_t hash_file(const char *file, bool *ok);
+string cache_name(const char *file, bool reverse, const char *kind = "cache");
+bool load_cache(const char *cfile, uint64_t key, bool reverse);
+bool save_cache(const char *cfile, uint64_t key, bool reverse);
+
+/* The bits and pieces the cache files are made of, for others that want
+   to write files like them.  Writing goes through stdio; reading walks a
+   cursor over a mapped file, and every read is checked against the end,
+   so a truncated or otherwise mangled file just sets bad.  */
+void put(FILE *f, const void *p, size_t n);
+void put_int(FILE *f, int32_t x);
+void put_string(FILE *f, const string &s);
+
+template <class T>
+void put_vector(FILE *f, const vector<T> &v) {
+  put_int(f, v.size());
+  if (!v.empty())
+    put(f, &v[0], v.size() * sizeof(T));
+}
+
+struct cursor {
+  const char *p, *end;
+  bool bad;
+
+  bool get(void *v, size_t n) {
+    if (bad || end - p < n) {
+      bad = true;
+      return false;
+    }
+    memcpy(v, p, n);
+    p += n;
+    return true;
+  }
+  int32_t get_int() {
+    int32_t x = 0;
+    get(&x, sizeof(x));
+    return x;
+  }
+  string get_string() {
+    int32_t n = get_int();
+    if (bad || n < 0 || end - p < n) {
+      bad = true;
+      return "";
+    }
+    string s(p, n);
+    p += n;
+    return s;
+  }
+  template <class T>
+  void get_vector(vector<T> &v) {
+    int32_t n = get_int();
+    if (bad || n < 0 || (end - p) / sizeof(T) < n) {
+      bad = true;
+      return;
+    }
+    v.resize(n);
+    if (n)
+      get(&v[0], n * sizeof(T));
+  }
+};
+
+/* Map a whole file in, or give NULL; and let it go again.  */
+const char *map_file(const char *file, size_t *size);
+void unmap_file(const char *m, size_t size);
+
+#endif
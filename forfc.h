@@ -2,6 +2,7 @@
 #define __RSCA_FORFC
 
 #include <vector>
+#include <algorithm>
 
 using namespace std;
 
@@ -34,7 +35,7 @@ struct forfc {
         }
       }
         else if (t.pos) {
-          vector<string> u(s);
+          vector<T> u(s);
           s = t.s;
           for(int i=s.size()-1; i>=0; i--)
             if (find(u.begin(), u.end(), s[i]) != u.end()) {
@@ -66,5 +67,81 @@ struct forfc {
   }
 };
 
+/* The sets we actually use are of interned phones, which are small
+   integers drawn from an inventory that doesn't change much after
+   parsing, so here's a bitset instead.  A phone beyond the end of b
+   is simply not in it, so sets made before a phone was interned
+   remain correct.  list() gives back the phones in whichever of the
+   set and its complement is finite, in increasing order.  */
+template <>
+struct forfc<int> {
+  vector<unsigned long> b;
+  bool pos; // true if this represents b, false if the complement of b
+
+  static const int W = 8 * sizeof(unsigned long);
+
+  forfc() : pos(true) {}
+  forfc(const vector<int> &s_, bool pos_ = true) : pos(pos_) {
+    for(int i=s_.size()-1; i>=0; i--)
+      add(s_[i]);
+  }
+  forfc(int a, bool pos_ = true) : pos(pos_) { add(a); }
+
+  void add(int x) {
+    if (x/W >= b.size())
+      b.resize(x/W + 1, 0);
+    b[x/W] |= 1UL << (x%W);
+  }
+
+  void complement() {
+    pos = !pos;
+  }
+
+  /* Intersect with t, or with the complement of t if flip.  */
+  void meet(const forfc<int> &t, bool flip) {
+    bool tpos = (t.pos != flip);
+    if (b.size() < t.b.size())
+      b.resize(t.b.size(), 0);
+    for(int i=b.size()-1; i>=0; i--) {
+      unsigned long u = i < t.b.size() ? t.b[i] : 0;
+      if (pos && tpos)
+        b[i] &= u;
+      else if (pos)
+        b[i] &= ~u;
+      else if (tpos)
+        b[i] = u & ~b[i];
+      else
+        b[i] |= u;
+    }
+    if (tpos)
+      pos = true;
+  }
+
+  void intersect(const forfc<int> &t) { meet(t, false); }
+  void subtract(const forfc<int> &t) { meet(t, true); }
+
+  bool empty() const {
+    if (!pos)
+      return false;
+    for(int i=b.size()-1; i>=0; i--)
+      if (b[i])
+        return false;
+    return true;
+  }
+
+  bool contains(int x) const {
+    bool n = x/W < b.size() && (b[x/W] >> (x%W) & 1);
+    return pos ? n : !n;
+  }
+
+  vector<int> list() const {
+    vector<int> v;
+    for(int i=0; i<b.size(); i++)
+      for(unsigned long u=b[i]; u; u &= u-1)
+        v.push_back(i*W + __builtin_ctzl(u));
+    return v;
+  }
+};
+
 #endif
 
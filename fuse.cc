@@ -0,0 +1,434 @@
+#include <stdio.h>
+
+#include "fuse.h"
+
+extern vector<automaton *> changes;
+extern vector<change_parameters *> change_stuff;
+
+/* Composition is a product construction, so fused automata can get big.
+   Past these sizes we stop and start a new one.  The same goes for the
+   subset construction in total().  */
+static const int max_fused_states = 4096;
+static const int max_fused_pool = 1 << 20;
+static const int max_subsets = 4096;
+
+/* Is t one of the transitions apply_zeros() follows, i.e. one that can be
+   taken without reading a phone?  Zero is the smallest phone, so if it's
+   among the triggers it's the first.  */
+static bool is_zero(const flat_table &f, const flat_transition &t) {
+  return t.pos && t.lo < t.hi && f.x[t.lo] == ZERO_PH;
+}
+
+/* Append the outcomes of t on the (nonzero) phone r to v, just as
+   transduce() would find them.  */
+static void outcomes(const flat_table &f, const flat_transition &t, int r, vector<int> &v) {
+  const int *lo = f.x.data() + t.lo, *hi = f.x.data() + t.hi;
+  if (t.pos) {
+    for(const int *k=lower_bound(lo, hi, r); k<hi && *k == r; k++)
+      v.push_back(f.y[k - f.x.data()]);
+  }
+  else if (!binary_search(lo, hi, r))
+    v.push_back(t.out == -1 ? r : t.out);
+}
+
+
+
+/* Whether the zero transitions of f are free of cycles.  If they aren't,
+   how many times transduce() goes round depends on max_epen and on which
+   states the way round passes through, and a product can't mimic that.
+   With no cycles every path is followed, whatever max_epen is.  */
+static bool zero_acyclic(const flat_table &f) {
+  int n = f.accept.size();
+  vector<char> colour(n, 0); // 0 unseen, 1 on the stack, 2 done
+  vector<pair<int, int> > stack;
+  for(int i=0; i<n; i++) {
+    if (colour[i])
+      continue;
+    colour[i] = 1;
+    stack.push_back(pair<int, int>(i, f.first[i]));
+    while (!stack.empty()) {
+      int s = stack.back().first, j = stack.back().second++;
+      if (j == f.first[s+1]) {
+        colour[s] = 2;
+        stack.pop_back();
+        continue;
+      }
+      const flat_transition &t = f.t[j];
+      if (!is_zero(f, t))
+        continue;
+      if (colour[t.d] == 1)
+        return false;
+      if (colour[t.d] == 0) {
+        colour[t.d] = 1;
+        stack.push_back(pair<int, int>(t.d, f.first[t.d]));
+      }
+    }
+  }
+  return true;
+}
+
+/* For boundary_safe(): what we know of the input read so far (nothing, or
+   whether it last read a "#"), and of the output so far (nothing, bounded
+   by "#"s, begun with a "#" but not ended with one, or beyond help).  */
+enum {NO_IN = 0, BOUND_IN, OTHER_IN};
+enum {EMPTY_OUT = 0, BOUNDED_OUT, OPEN_OUT, BAD_OUT};
+
+static int emit(int out, int r) {
+  if (r == ZERO_PH || out == BAD_OUT)
+    return out;
+  if (r == BOUND_PH)
+    return BOUNDED_OUT;
+  return out == EMPTY_OUT ? BAD_OUT : OPEN_OUT;
+}
+
+static void visit(vector<char> &seen, vector<int> &stack, int q, int in, int out) {
+  int k = (q*3 + in)*4 + out;
+  if (!seen[k]) {
+    seen[k] = 1;
+    stack.push_back(k);
+  }
+}
+
+/* Whether every outcome of f on a word bounded by "#"s is bounded by "#"s
+   too, so that apply_word() never has to fix it up and it can be fed
+   straight to the next change.  We run f on words of which we only know
+   where the "#"s are; any phone that isn't "#" stands for all of them, so
+   OTHER_PH does nicely as the outcome of an identity.  */
+static bool boundary_safe(const flat_table &f, int q0) {
+  vector<char> seen(f.accept.size() * 12, 0);
+  vector<int> stack;
+  visit(seen, stack, q0, NO_IN, EMPTY_OUT);
+  while (!stack.empty()) {
+    int k = stack.back();
+    stack.pop_back();
+    int q = k/12, in = k/4%3, out = k%4;
+    if (f.accept[q] && in == BOUND_IN && out != BOUNDED_OUT)
+      return false;
+
+    for(int j=f.first[q]; j<f.first[q+1]; j++) {
+      const flat_transition &t = f.t[j];
+      if (t.pos) {
+        for(int i=t.lo; i<t.hi; i++)
+          if (f.x[i] == ZERO_PH)
+            visit(seen, stack, t.d, in, emit(out, f.y[i]));
+          else if (f.x[i] == BOUND_PH)
+            visit(seen, stack, t.d, BOUND_IN, emit(out, f.y[i]));
+          else if (in != NO_IN)
+            visit(seen, stack, t.d, OTHER_IN, emit(out, f.y[i]));
+      }
+      else {
+        /* There's always some phone that isn't one of the exceptions.  */
+        if (in != NO_IN)
+          visit(seen, stack, t.d, OTHER_IN, emit(out, t.out == -1 ? OTHER_PH : t.out));
+        if (!binary_search(f.x.begin() + t.lo, f.x.begin() + t.hi, BOUND_PH))
+          visit(seen, stack, t.d, BOUND_IN, emit(out, t.out == -1 ? BOUND_PH : t.out));
+      }
+    }
+  }
+  return true;
+}
+
+/* Close the set of states s (with no repeats) under zero transitions,
+   and sort it.  */
+static void zero_closure(const flat_table &f, vector<int> &s) {
+  vector<char> in(f.accept.size(), 0);
+  for(int i=0; i<s.size(); i++)
+    in[s[i]] = 1;
+  for(int i=0; i<s.size(); i++)
+    for(int j=f.first[s[i]]; j<f.first[s[i]+1]; j++)
+      if (is_zero(f, f.t[j]) && !in[f.t[j].d]) {
+        in[f.t[j].d] = 1;
+        s.push_back(f.t[j].d);
+      }
+  sort(s.begin(), s.end());
+}
+
+/* The states f can be in after reading r from any of the states s.  */
+static vector<int> step(const flat_table &f, const vector<int> &s, int r) {
+  vector<int> d, u;
+  for(int i=0; i<s.size(); i++)
+    for(int j=f.first[s[i]]; j<f.first[s[i]+1]; j++) {
+      u.clear();
+      outcomes(f, f.t[j], r, u);
+      if (!u.empty())
+        d.push_back(f.t[j].d);
+    }
+  sort(d.begin(), d.end());
+  d.erase(unique(d.begin(), d.end()), d.end());
+  zero_closure(f, d);
+  return d;
+}
+
+/* Whether f has an outcome for every word bounded by "#"s, so that it can
+   never be the change a "doesn't satisfy constraint" warning is about.
+   This is a subset construction on the input side of f, over the phones f
+   mentions and -2 standing for all the others.  */
+static bool total(const flat_table &f, int q0) {
+  vector<int> alphabet(f.x);
+  alphabet.push_back(BOUND_PH);
+  alphabet.push_back(-2);
+  sort(alphabet.begin(), alphabet.end());
+  alphabet.erase(unique(alphabet.begin(), alphabet.end()), alphabet.end());
+  alphabet.erase(remove(alphabet.begin(), alphabet.end(), (int)ZERO_PH), alphabet.end());
+
+  vector<int> s0(1, q0);
+  zero_closure(f, s0);
+  set<vector<int> > seen;
+  deque<vector<int> > queue;
+  queue.push_back(step(f, s0, BOUND_PH));
+  seen.insert(queue.back());
+  while (!queue.empty()) {
+    vector<int> s = queue.front();
+    queue.pop_front();
+
+    /* Could the word end here?  */
+    vector<int> e = step(f, s, BOUND_PH);
+    bool accepts = false;
+    for(int i=e.size()-1; i>=0 && !accepts; i--)
+      accepts = f.accept[e[i]];
+    if (!accepts)
+      return false;
+
+    for(int i=0; i<alphabet.size(); i++) {
+      vector<int> t = step(f, s, alphabet[i]);
+      if (seen.insert(t).second) {
+        if (seen.size() > max_subsets)
+          return false;
+        queue.push_back(t);
+      }
+    }
+  }
+  return true;
+}
+
+
+
+/* The transitions out of one state of a composition, gathered up before
+   they're laid out: the pos ones as (trigger, outcome) pairs by destination,
+   and the neg ones as ((destination, outcome), exceptions).  */
+struct fused_state {
+  map<int, set<pair<int, int> > > pos;
+  set<pair<pair<int, int>, vector<int> > > neg;
+};
+
+static int fused_label(map<pair<int, int>, int> &label, vector<pair<int, int> > &pairs, int p, int q) {
+  pair<map<pair<int, int>, int>::iterator, bool> ii =
+    label.insert(pair<pair<int, int>, int>(pair<int, int>(p, q), pairs.size()));
+  if (ii.second)
+    pairs.push_back(pair<int, int>(p, q));
+  return ii.first->second;
+}
+
+/* The composition of a followed by b: an automaton whose outcomes on a word
+   are all of b's outcomes on all of a's.  Its states are pairs of states of
+   a and b; a reads the input, and whatever a writes b reads in turn.  Both
+   must be compiled and have acyclic zero transitions.  Only the flat table
+   of the result is filled in, since that's all transduce() uses, and NULL
+   is returned if it gets too big.  */
+automaton *compose(automaton *a, automaton *b) {
+  const flat_table &f = a->f, &g = b->f;
+  map<pair<int, int>, int> label;
+  vector<pair<int, int> > pairs;
+  vector<fused_state> z;
+  vector<int> v;
+
+  fused_label(label, pairs, a->q0, b->q0);
+  for(int s=0; s<pairs.size(); s++) {
+    if (pairs.size() > max_fused_states)
+      return NULL;
+    int p = pairs[s].first, q = pairs[s].second;
+    fused_state w;
+
+    for(int j=f.first[p]; j<f.first[p+1]; j++) {
+      const flat_transition &t = f.t[j];
+      if (t.pos) {
+        for(int k=t.lo; k<t.hi; k++) {
+          int r = f.x[k], u = f.y[k];
+          if (u == ZERO_PH) {
+            w.pos[fused_label(label, pairs, t.d, q)].insert(pair<int, int>(r, ZERO_PH));
+            continue;
+          }
+          for(int jj=g.first[q]; jj<g.first[q+1]; jj++) {
+            v.clear();
+            outcomes(g, g.t[jj], u, v);
+            for(int m=0; m<v.size(); m++)
+              w.pos[fused_label(label, pairs, t.d, g.t[jj].d)].insert(pair<int, int>(r, v[m]));
+          }
+        }
+        continue;
+      }
+
+      vector<int> ex(f.x.begin() + t.lo, f.x.begin() + t.hi);
+      if (t.out == ZERO_PH)
+        w.neg.insert(make_pair(make_pair(fused_label(label, pairs, t.d, q), (int)ZERO_PH), ex));
+      else if (t.out != -1)
+        for(int jj=g.first[q]; jj<g.first[q+1]; jj++) {
+          v.clear();
+          outcomes(g, g.t[jj], t.out, v);
+          for(int m=0; m<v.size(); m++)
+            w.neg.insert(make_pair(make_pair(fused_label(label, pairs, t.d, g.t[jj].d), v[m]), ex));
+        }
+      else
+        /* An identity: whatever b does with the phone, less a's exceptions.  */
+        for(int jj=g.first[q]; jj<g.first[q+1]; jj++) {
+          const flat_transition &tt = g.t[jj];
+          if (tt.pos) {
+            for(int k=tt.lo; k<tt.hi; k++)
+              if (g.x[k] != ZERO_PH && !binary_search(ex.begin(), ex.end(), g.x[k]))
+                w.pos[fused_label(label, pairs, t.d, tt.d)].insert(pair<int, int>(g.x[k], g.y[k]));
+          }
+          else {
+            vector<int> ex2;
+            set_union(ex.begin(), ex.end(), g.x.begin() + tt.lo, g.x.begin() + tt.hi,
+                      back_inserter(ex2));
+            w.neg.insert(make_pair(make_pair(fused_label(label, pairs, t.d, tt.d), tt.out), ex2));
+          }
+        }
+    }
+
+    /* b's own zero transitions.  */
+    for(int jj=g.first[q]; jj<g.first[q+1]; jj++) {
+      const flat_transition &tt = g.t[jj];
+      for(int k=tt.lo; tt.pos && k<tt.hi && g.x[k] == ZERO_PH; k++)
+        w.pos[fused_label(label, pairs, p, tt.d)].insert(pair<int, int>(ZERO_PH, g.y[k]));
+    }
+
+    z.push_back(w);
+  }
+
+  /* Throw away the states that can't lead to acceptance; there tend to
+     be a lot.  */
+  int n = pairs.size();
+  vector<vector<int> > from(n);
+  vector<char> live(n, 0);
+  vector<int> stack;
+  for(int s=0; s<n; s++) {
+    for(map<int, set<pair<int, int> > >::iterator ii=z[s].pos.begin(); ii!=z[s].pos.end(); ++ii)
+      from[ii->first].push_back(s);
+    for(set<pair<pair<int, int>, vector<int> > >::iterator ii=z[s].neg.begin(); ii!=z[s].neg.end(); ++ii)
+      from[ii->first.first].push_back(s);
+    if (f.accept[pairs[s].first] && g.accept[pairs[s].second]) {
+      live[s] = 1;
+      stack.push_back(s);
+    }
+  }
+  while (!stack.empty()) {
+    int s = stack.back();
+    stack.pop_back();
+    for(int i=from[s].size()-1; i>=0; i--)
+      if (!live[from[s][i]]) {
+        live[from[s][i]] = 1;
+        stack.push_back(from[s][i]);
+      }
+  }
+
+  vector<int> num(n, -1);
+  int m = 0;
+  for(int s=0; s<n; s++)
+    if (live[s] || s == 0)
+      num[s] = m++;
+
+  automaton *c = new automaton(0);
+  flat_table &h = c->f;
+  for(int s=0; s<n; s++) {
+    if (num[s] < 0)
+      continue;
+    h.first.push_back(h.t.size());
+    h.accept.push_back(f.accept[pairs[s].first] && g.accept[pairs[s].second]);
+    for(map<int, set<pair<int, int> > >::iterator ii=z[s].pos.begin(); ii!=z[s].pos.end(); ++ii) {
+      if (!live[ii->first])
+        continue;
+      flat_transition ft;
+      ft.d = num[ii->first];
+      ft.pos = true;
+      ft.out = -1;
+      ft.lo = h.x.size();
+      for(set<pair<int, int> >::iterator jj=ii->second.begin(); jj!=ii->second.end(); ++jj) {
+        h.x.push_back(jj->first);
+        h.y.push_back(jj->second);
+      }
+      ft.hi = h.x.size();
+      h.t.push_back(ft);
+    }
+    for(set<pair<pair<int, int>, vector<int> > >::iterator ii=z[s].neg.begin(); ii!=z[s].neg.end(); ++ii) {
+      if (!live[ii->first.first])
+        continue;
+      flat_transition ft;
+      ft.d = num[ii->first.first];
+      ft.pos = false;
+      ft.out = ii->first.second;
+      ft.lo = h.x.size();
+      for(int k=0; k<ii->second.size(); k++) {
+        h.x.push_back(ii->second[k]);
+        h.y.push_back(-1);
+      }
+      ft.hi = h.x.size();
+      h.t.push_back(ft);
+    }
+  }
+  h.first.push_back(h.t.size());
+  c->q0 = c->q1 = 0;
+  c->minimise();
+
+  if (h.x.size() > max_fused_pool) {
+    delete c;
+    return NULL;
+  }
+  return c;
+}
+
+
+
+/* Whether a change can be part of a fused automaton at all.  One that's
+   being built lazily isn't all there to be looked at.  */
+static bool fusible(automaton *a, change_parameters *p) {
+  return a->lazy == NULL && p->max_epen >= 1 && zero_acyclic(a->f) && boundary_safe(a->f, a->q0);
+}
+
+/* Replace each maximal run of fusible changes (with the same reflect, and
+   not too big) by their composition.  If we're complaining about constraint
+   failures, only the first change of a run may ever have no outcome, so that
+   the warnings come out just as they would have.  */
+void fuse_changes(bool complaint) {
+  vector<automaton *> fused;
+  vector<change_parameters *> fused_stuff;
+  int n = changes.size();
+
+  for(int i=0; i<n; ) {
+    automaton *a = changes[i];
+    change_parameters *p = change_stuff[i];
+    double t0 = now();
+    int j = i+1;
+    if (fusible(a, p))
+      for(; j<n; j++) {
+        if (change_stuff[j]->reflect != p->reflect || !fusible(changes[j], change_stuff[j]) ||
+            (complaint && !total(changes[j]->f, changes[j]->q0)))
+          break;
+        automaton *b = compose(a, changes[j]);
+        if (b == NULL)
+          break;
+        if (a != changes[i])
+          delete a;
+        a = b;
+      }
+
+    if (j > i+1) {
+      /* The first change lends its name to the warnings, since any
+         constraint failure is its.  */
+      p = new change_parameters(*p);
+      p->max_epen = 1;
+      p->build_time += now() - t0;
+      for(int k=i+1; k<j; k++)
+        p->build_time += change_stuff[k]->build_time;
+      fprintf(stderr, "fused changes %d-%d into one automaton with %d states\n",
+              i+1, j, (int)a->f.accept.size());
+    }
+    fused.push_back(a);
+    fused_stuff.push_back(p);
+    i = j;
+  }
+
+  fprintf(stderr, "%d sound changes fused into %d stages\n", n, (int)fused.size());
+  changes = fused;
+  change_stuff = fused_stuff;
+}
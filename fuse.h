@@ -0,0 +1,16 @@
+#ifndef __RSCA_FUSE
+#define __RSCA_FUSE
+
+#include "automaton.h"
+#include "soundchange.h"
+
+/* Fusing runs of consecutive sound changes.  Where it's safe, a run of
+   changes is replaced by the composition of their compiled automata, so
+   that each word makes one pass through it rather than one per change,
+   and no intermediate sets of forms get built.  fuse_changes() rewrites
+   changes and change_stuff in place, and says what it did on stderr.  */
+
+automaton *compose(automaton *a, automaton *b);
+void fuse_changes(bool complaint);
+
+#endif
@@ -0,0 +1,214 @@
+#include <unistd.h>
+
+#include "memo.h"
+#include "cache.h"
+
+extern vector<automaton *> changes;
+
+static const uint32_t memo_version = 1;
+static const char memo_magic[4] = {'R', 'S', 'C', 'M'};
+
+memo_table::memo_table(size_t bytes) {
+  n = 16;
+  shards = new memo_shard[n];
+  cap = bytes / n;
+  for(int k=0; k<n; k++) {
+    pthread_mutex_init(&shards[k].lock, NULL);
+    shards[k].bytes = 0;
+    shards[k].hits = shards[k].misses = shards[k].evictions = 0;
+  }
+}
+
+memo_table::~memo_table() {
+  for(int k=0; k<n; k++)
+    pthread_mutex_destroy(&shards[k].lock);
+  delete[] shards;
+}
+
+/* The cost of an entry: the forms themselves, and a guess at the
+   overhead of the containers holding them.  */
+static size_t form_bytes(const vector<int> &v) {
+  return sizeof(vector<int>) + v.size() * sizeof(int);
+}
+
+static size_t entry_bytes(const vector<int> &x, const form_set &s) {
+  size_t b = 128 + form_bytes(x);
+  for(form_set::const_iterator ii=s.begin(); ii!=s.end(); ++ii)
+    b += 32 + form_bytes(*ii);
+  return b;
+}
+
+/* A copy of what change i made of x, or NULL if we don't know.  */
+form_set *memo_table::find(int i, const vector<int> &x) {
+  memo_key k(i, x);
+  size_t h = memo_hash()(k);
+  memo_shard &m = shards[h % n];
+  form_set *s = NULL;
+
+  pthread_mutex_lock(&m.lock);
+  unordered_map<memo_key, memo_entry, memo_hash>::iterator ii = m.table.find(k);
+  if (ii == m.table.end())
+    m.misses++;
+  else {
+    m.hits++;
+    m.ages.splice(m.ages.begin(), m.ages, ii->second.age);
+    s = new form_set(ii->second.s);
+  }
+  pthread_mutex_unlock(&m.lock);
+  return s;
+}
+
+/* Remember that change i made s of x.  Entries bigger than a shard's whole
+   share aren't worth keeping.  */
+void memo_table::add(int i, const vector<int> &x, const form_set &s) {
+  memo_key k(i, x);
+  size_t h = memo_hash()(k), b = entry_bytes(x, s);
+  memo_shard &m = shards[h % n];
+  if (b > cap)
+    return;
+
+  pthread_mutex_lock(&m.lock);
+  pair<unordered_map<memo_key, memo_entry, memo_hash>::iterator, bool> ii =
+    m.table.insert(make_pair(k, memo_entry()));
+  if (ii.second) {
+    ii.first->second.s = s;
+    ii.first->second.bytes = b;
+    m.ages.push_front(&ii.first->first);
+    ii.first->second.age = m.ages.begin();
+    m.bytes += b;
+
+    while (m.bytes > cap) {
+      unordered_map<memo_key, memo_entry, memo_hash>::iterator jj = m.table.find(*m.ages.back());
+      m.bytes -= jj->second.bytes;
+      m.ages.pop_back();
+      m.table.erase(jj);
+      m.evictions++;
+    }
+  }
+  pthread_mutex_unlock(&m.lock);
+}
+
+void memo_table::stats(FILE *f) {
+  unsigned long hits = 0, misses = 0, evictions = 0, entries = 0;
+  size_t bytes = 0;
+  for(int k=0; k<n; k++) {
+    hits += shards[k].hits;
+    misses += shards[k].misses;
+    evictions += shards[k].evictions;
+    entries += shards[k].table.size();
+    bytes += shards[k].bytes;
+  }
+  fprintf(f, "memo: %lu hits, %lu misses (%.1f%% hit), %lu entries in %lu kB, %lu evicted\n",
+          hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+          entries, (unsigned long)(bytes >> 10), evictions);
+}
+
+
+
+/* The memo can be kept between runs next to the cache, as long as the
+   rule file and the way it was compiled stay the same.  The forms are
+   written with phone ids of this run, so the phone table goes along too
+   and they're translated on the way back in.  Entries are written least
+   recently used first, so that loading them in order leaves the ages as
+   they were.  */
+bool memo_table::save(const char *file, uint64_t key, int fused) {
+  string tmp = string(file) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f)
+    return false;
+
+  put(f, memo_magic, 4);
+  put_int(f, memo_version);
+  put(f, &key, sizeof(key));
+  put_int(f, fused);
+  put_int(f, changes.size());
+  put_int(f, phone_name.size());
+  for(int i=0; i<phone_name.size(); i++)
+    put_string(f, phone_name[i]);
+
+  int entries = 0;
+  for(int k=0; k<n; k++)
+    entries += shards[k].table.size();
+  put_int(f, entries);
+  for(int k=0; k<n; k++)
+    for(list<const memo_key *>::reverse_iterator ii=shards[k].ages.rbegin(); ii!=shards[k].ages.rend(); ++ii) {
+      const form_set &s = shards[k].table.find(**ii)->second.s;
+      put_int(f, (*ii)->i);
+      put_vector(f, (*ii)->x);
+      put_int(f, s.size());
+      for(form_set::const_iterator jj=s.begin(); jj!=s.end(); ++jj)
+        put_vector(f, *jj);
+    }
+
+  bool ok = !ferror(f);
+  if (fclose(f) || !ok || rename(tmp.c_str(), file)) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+static bool translate(vector<int> &v, const vector<int> &id) {
+  for(int k=v.size()-1; k>=0; k--) {
+    if (v[k] < 0 || v[k] >= id.size())
+      return false;
+    v[k] = id[v[k]];
+  }
+  return true;
+}
+
+/* Nothing is added unless the whole file checks out.  */
+bool memo_table::load(const char *file, uint64_t key, int fused) {
+  size_t size;
+  const char *m = map_file(file, &size);
+  if (m == NULL)
+    return false;
+
+  cursor c = {m, m + size, false};
+  char magic[4];
+  uint64_t k;
+  c.get(magic, 4);
+  bool ok = !memcmp(magic, memo_magic, 4) && c.get_int() == memo_version &&
+    c.get(&k, sizeof(k)) && k == key && c.get_int() == fused && c.get_int() == changes.size();
+
+  vector<string> names;
+  vector<pair<memo_key, form_set> > e;
+  if (ok) {
+    for(int i=c.get_int(); i>0 && !c.bad; i--)
+      names.push_back(c.get_string());
+
+    /* The forms can't go into form_sets until they're translated, since
+       those are ordered by phone_rank.  */
+    vector<pair<memo_key, vector<vector<int> > > > raw;
+    for(int i=c.get_int(); i>0 && !c.bad; i--) {
+      int j = c.get_int();
+      raw.push_back(make_pair(memo_key(j, vector<int>()), vector<vector<int> >()));
+      c.get_vector(raw.back().first.x);
+      ok = ok && j >= 0 && j < changes.size();
+      for(int l=c.get_int(); l>0 && !c.bad; l--) {
+        raw.back().second.push_back(vector<int>());
+        c.get_vector(raw.back().second.back());
+      }
+    }
+    ok = ok && !c.bad && c.p == c.end;
+
+    vector<int> id;
+    for(int i=0; ok && i<names.size(); i++)
+      id.push_back(intern(names[i]));
+    for(int i=0; ok && i<raw.size(); i++) {
+      ok = translate(raw[i].first.x, id);
+      e.push_back(make_pair(raw[i].first, form_set()));
+      for(int l=0; ok && l<raw[i].second.size(); l++) {
+        ok = translate(raw[i].second[l], id);
+        e.back().second.insert(raw[i].second[l]);
+      }
+    }
+  }
+  unmap_file(m, size);
+
+  if (!ok)
+    return false;
+  for(int i=0; i<e.size(); i++)
+    add(e[i].first.i, e[i].first.x, e[i].second);
+  return true;
+}
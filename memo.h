@@ -0,0 +1,67 @@
+#ifndef __RSCA_MEMO
+#define __RSCA_MEMO
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <list>
+#include <unordered_map>
+
+#include "automaton.h"
+
+using namespace std;
+
+/* Remembered results of single changes: which forms change i turned form x
+   into.  Lexicons are full of words that look alike after the first few
+   changes, so the same (i, x) comes up over and over.  The table is split
+   into shards, each with its own lock, so the -j workers can share it, and
+   each shard throws out its least recently used entries once it's over
+   its share of the memory allowed.  */
+struct memo_key {
+  int i;
+  vector<int> x;
+
+  memo_key(int i_, const vector<int> &x_) : i(i_), x(x_) {}
+  bool operator==(const memo_key &k) const { return i == k.i && x == k.x; }
+};
+
+struct memo_hash {
+  size_t operator()(const memo_key &k) const {
+    uint64_t h = 14695981039346656037ULL ^ k.i;
+    for(int j=0; j<k.x.size(); j++)
+      h = (h ^ k.x[j]) * 1099511628211ULL;
+    return h;
+  }
+};
+
+struct memo_entry {
+  form_set s;
+  size_t bytes; // roughly what this entry costs us
+  list<const memo_key *>::iterator age;
+};
+
+struct memo_shard {
+  pthread_mutex_t lock;
+  unordered_map<memo_key, memo_entry, memo_hash> table;
+  list<const memo_key *> ages; // most recently used first
+  size_t bytes;
+  unsigned long hits, misses, evictions;
+};
+
+struct memo_table {
+  int n;
+  memo_shard *shards;
+  size_t cap; // per shard
+
+  memo_table(size_t bytes);
+  ~memo_table();
+
+  form_set *find(int i, const vector<int> &x);
+  void add(int i, const vector<int> &x, const form_set &s);
+  void stats(FILE *f);
+
+  bool load(const char *file, uint64_t key, int fused);
+  bool save(const char *file, uint64_t key, int fused);
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "phones.h"
+
+vector<string> phone_name;
+vector<int> phone_rank;
+map<string, int> wide_modtype;
+
+/* The ids of the phones by (FNV-1a) hash of their names, -1 where
+   there's none; open addressing, and never more than half full.  */
+static vector<int> slot;
+
+static uint32_t hash_name(const char *s, int n) {
+  uint32_t h = 2166136261U;
+  for(int i=0; i<n; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619U;
+  return h;
+}
+
+static int lookup(const char *s, int n) {
+  if (slot.empty())
+    return -1;
+  for(uint32_t h = hash_name(s, n) & (slot.size()-1); slot[h] >= 0; h = (h+1) & (slot.size()-1)) {
+    const string &p = phone_name[slot[h]];
+    if (p.size() == n && !memcmp(p.data(), s, n))
+      return slot[h];
+  }
+  return -1;
+}
+
+static void place(int k) {
+  uint32_t h = hash_name(phone_name[k].data(), phone_name[k].size()) & (slot.size()-1);
+  while (slot[h] >= 0)
+    h = (h+1) & (slot.size()-1);
+  slot[h] = k;
+}
+
+/* Put phone k in the table, making it bigger first if need be.  */
+static void add(int k) {
+  if (2 * phone_name.size() <= slot.size()) {
+    place(k);
+    return;
+  }
+  size_t m = 64;
+  while (m < 4 * phone_name.size())
+    m *= 2;
+  slot.assign(m, -1);
+  for(int i=0; i<phone_name.size(); i++)
+    place(i);
+}
+
+static void rerank() {
+  vector<pair<string, int> > v;
+  for(int i=phone_name.size()-1; i>=0; i--)
+    v.push_back(pair<string, int>(phone_name[i], i));
+  sort(v.begin(), v.end());
+  phone_rank.resize(v.size());
+  for(int i=v.size()-1; i>=0; i--)
+    phone_rank[v[i].second] = i;
+}
+
+/* Return the id of the phone s, making one up if it's new.  New phones
+   are rare after the rule file is parsed (only the odd unknown phone
+   in the input), so it's fine to redo the ranking every time.  */
+int intern(const string &s) {
+  if (phone_name.empty()) {
+    const char *special[] = {"0", "#", "*"};
+    for(int i=0; i<3; i++) {
+      phone_name.push_back(special[i]);
+      add(i);
+    }
+    rerank();
+  }
+
+  int k = lookup(s.data(), s.size());
+  if (k >= 0)
+    return k;
+
+  k = phone_name.size();
+  phone_name.push_back(s);
+  add(k);
+  rerank();
+  return k;
+}
+
+/* The same for the n bytes at s, without making a string of them unless
+   the phone is new.  Unless make, a new phone isn't made at all, and we
+   say -1; this never changes anything, so it's safe alongside threads
+   that are using the phones.  */
+int find_phone(const char *s, int n, bool make) {
+  int k = lookup(s, n);
+  return k >= 0 || !make ? k : intern(string(s, n));
+}
+
+int unit_modtype(const char *s, int n) {
+  if (n == 1)
+    return modtype[(unsigned char)s[0]];
+  if (wide_modtype.empty())
+    return 0;
+  map<string, int>::iterator ii = wide_modtype.find(string(s, n));
+  return ii == wide_modtype.end() ? 0 : ii->second;
+}
+
+/* Give every unit of the n bytes at s the modifier type type (for the
+   lexer's mod lines).  */
+void set_modtypes(const char *s, int n, int type) {
+  for(int i=0, k; i<n; i+=k) {
+    k = unit_length(s+i, n-i);
+    if (k == 1)
+      modtype[(unsigned char)s[i]] = type;
+    else
+      wide_modtype[string(s+i, k)] = type;
+  }
+}
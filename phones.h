@@ -0,0 +1,65 @@
+#ifndef __RSCA_PHONES
+#define __RSCA_PHONES
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using namespace std;
+
+/* Phones are interned into small integers as soon as they're read, and
+   everything downstream of the parser works with these ids; the
+   strings are only looked at again when output is printed.
+   The first few ids are reserved for the phones with special meanings.  */
+enum {ZERO_PH = 0, BOUND_PH, OTHER_PH}; // "0", "#" and the fake phone "*"
+
+extern vector<string> phone_name;
+extern vector<int> phone_rank;
+
+int intern(const string &s);
+int find_phone(const char *s, int n, bool make = true);
+
+/* Text is made of units: a byte, or a UTF-8 lead byte together with the
+   continuation bytes after it.  The lexer and tokenise() both go by
+   units, so that a modifier like "ʰ" is one thing, as "h" would be.
+   The type of a one-byte unit is in modtype[] (which the lexer owns);
+   the rest are in wide_modtype.  */
+extern int modtype[256];
+extern map<string, int> wide_modtype;
+
+static inline int unit_length(const char *s, int n) {
+  int k = 1;
+  if ((unsigned char)s[0] >= 0xc0)
+    while (k < n && (s[k] & 0xc0) == 0x80)
+      k++;
+  return k;
+}
+
+int unit_modtype(const char *s, int n);
+void set_modtypes(const char *s, int n, int type);
+
+/* Ids are handed out in order of appearance, but the order in which
+   alternatives get printed (and, less visibly, the order in which the
+   determinisation constructs things) has always been that of the
+   phones' strings.  phone_rank keeps that order available without
+   comparing any strings.  */
+struct phone_less {
+  bool operator()(int a, int b) const { return phone_rank[a] < phone_rank[b]; }
+};
+
+struct form_less {
+  bool operator()(const vector<int> &a, const vector<int> &b) const {
+    return lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), phone_less());
+  }
+};
+
+struct reach_less {
+  bool operator()(const pair<int, vector<int> > &a, const pair<int, vector<int> > &b) const {
+    if (a.first != b.first)
+      return a.first < b.first;
+    return form_less()(a.second, b.second);
+  }
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "pool.h"
+
+static void *worker_main(void *p) {
+  ((worker_pool *)p)->work();
+  return NULL;
+}
+
+worker_pool::worker_pool(int threads_) {
+  threads = threads_ < 1 ? 1 : threads_;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&go, NULL);
+  pthread_cond_init(&done, NULL);
+  n = next = finished = generation = 0;
+  quitting = false;
+
+  /* The calling thread works too, so we need one fewer.  */
+  tid = vector<pthread_t>(threads - 1);
+  for(int i=0; i<tid.size(); i++)
+    pthread_create(&tid[i], NULL, worker_main, this);
+}
+
+worker_pool::~worker_pool() {
+  pthread_mutex_lock(&lock);
+  quitting = true;
+  pthread_cond_broadcast(&go);
+  pthread_mutex_unlock(&lock);
+  for(int i=0; i<tid.size(); i++)
+    pthread_join(tid[i], NULL);
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&go);
+  pthread_cond_destroy(&done);
+}
+
+/* Take jobs from the current batch until there are none left.  The lock
+   is held on entry and on exit.  */
+static void drain(worker_pool *w) {
+  while (w->next < w->n) {
+    int i = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    w->job(i, w->arg);
+    pthread_mutex_lock(&w->lock);
+    if (++w->finished == w->n)
+      pthread_cond_broadcast(&w->done);
+  }
+}
+
+void worker_pool::work() {
+  int seen = 0;
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (!quitting && generation == seen)
+      pthread_cond_wait(&go, &lock);
+    if (quitting)
+      break;
+    seen = generation;
+    drain(this);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void worker_pool::run(int n_, void (*job_)(int, void *), void *arg_) {
+  if (tid.empty() || n_ <= 1) {
+    for(int i=0; i<n_; i++)
+      job_(i, arg_);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  job = job_; arg = arg_;
+  n = n_; next = 0; finished = 0;
+  generation++;
+  pthread_cond_broadcast(&go);
+  drain(this);
+  while (finished < n)
+    pthread_cond_wait(&done, &lock);
+  pthread_mutex_unlock(&lock);
+}
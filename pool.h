@@ -0,0 +1,31 @@
+#ifndef __RSCA_POOL
+#define __RSCA_POOL
+
+#include <pthread.h>
+#include <vector>
+
+using namespace std;
+
+/* A fixed set of worker threads, to which we hand batches of independent
+   jobs numbered 0 to n-1.  run() returns once all of them are done.
+   With one thread (or one job) everything happens in the caller.  */
+struct worker_pool {
+  int threads;
+  vector<pthread_t> tid;
+  pthread_mutex_t lock;
+  pthread_cond_t go, done;
+
+  /* the current batch */
+  void (*job)(int, void *);
+  void *arg;
+  int n, next, finished, generation;
+  bool quitting;
+
+  worker_pool(int threads_);
+  ~worker_pool();
+
+  void run(int n_, void (*job_)(int, void *), void *arg_);
+  void work();
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "profile.h"
+#include "soundchange.h"
+
+extern vector<automaton *> changes;
+extern vector<change_parameters *> change_stuff;
+
+change_profile::change_profile() : seconds(0), calls(0), outputs(0), max_fanout(0) {
+  pthread_mutex_init(&lock, NULL);
+}
+
+change_profile::~change_profile() {
+  pthread_mutex_destroy(&lock);
+}
+
+void change_profile::add(double t, unsigned long forms, unsigned long out, unsigned long most, const transduce_stats &s) {
+  pthread_mutex_lock(&lock);
+  seconds += t;
+  calls += forms;
+  outputs += out;
+  if (most > max_fanout)
+    max_fanout = most;
+  st.entries += s.entries;
+  st.zero_calls += s.zero_calls;
+  if (s.peak > st.peak)
+    st.peak = s.peak;
+  pthread_mutex_unlock(&lock);
+}
+
+string json_string(const string &s) {
+  string r = "\"";
+  for(int i=0; i<s.size(); i++) {
+    char b[8];
+    if (s[i] == '"' || s[i] == '\\')
+      (r += '\\') += s[i];
+    else if ((unsigned char)s[i] < 0x20) {
+      snprintf(b, sizeof(b), "\\u%04x", s[i]);
+      r += b;
+    }
+    else
+      r += s[i];
+  }
+  return r + "\"";
+}
+
+/* One line per change, in the order they're applied, either as a table
+   or as a JSON array.  Build times are what parsing took, so they're 0
+   for changes that came out of the cache.  */
+void report_profile(FILE *f, const change_profile *p, bool json) {
+  if (json)
+    fprintf(f, "[");
+  else
+    fprintf(f, "%10s %8s %8s %7s %6s %12s %8s %12s %10s %7s %8s  %s\n",
+            "seconds", "forms", "outputs", "fanout", "most", "entries", "peak",
+            "zero calls", "build", "states", "trans", "change");
+
+  for(int i=0; i<changes.size(); i++) {
+    const change_profile &c = p[i];
+    double fanout = c.calls ? (double)c.outputs / c.calls : 0.0;
+    int states = changes[i]->f.accept.size(), trans = changes[i]->f.t.size();
+    if (json)
+      fprintf(f, "%s\n {\"change\": %s, \"seconds\": %.6f, \"forms\": %lu, \"outputs\": %lu, "
+              "\"fanout\": %.3f, \"max_fanout\": %lu, \"entries\": %lu, \"peak_frontier\": %lu, "
+              "\"zero_calls\": %lu, \"build_seconds\": %.6f, \"states\": %d, \"transitions\": %d}",
+              i ? "," : "", json_string(change_stuff[i]->name).c_str(), c.seconds, c.calls, c.outputs,
+              fanout, c.max_fanout, c.st.entries, c.st.peak, c.st.zero_calls,
+              change_stuff[i]->build_time, states, trans);
+    else
+      fprintf(f, "%10.6f %8lu %8lu %7.3f %6lu %12lu %8lu %12lu %10.6f %7d %8d  %s\n",
+              c.seconds, c.calls, c.outputs, fanout, c.max_fanout, c.st.entries, c.st.peak,
+              c.st.zero_calls, change_stuff[i]->build_time, states, trans, change_stuff[i]->name.c_str());
+  }
+
+  if (json)
+    fprintf(f, "\n]\n");
+}
@@ -0,0 +1,33 @@
+#ifndef __RSCA_PROFILE
+#define __RSCA_PROFILE
+
+#include <stdio.h>
+#include <pthread.h>
+#include <string>
+
+#include "automaton.h"
+
+using namespace std;
+
+/* Where the time goes, change by change, for -P.  Each transduction adds
+   what it cost to its change's profile; the workers share these, so each
+   has a lock, but it's only taken once per transduction.  None of this
+   happens unless profiling was asked for.  */
+struct change_profile {
+  pthread_mutex_t lock;
+  double seconds; // in transduce()
+  unsigned long calls; // forms transduced
+  unsigned long outputs; // forms they gave
+  unsigned long max_fanout; // the most any one form gave
+  transduce_stats st; // summed, except for the peak
+
+  change_profile();
+  ~change_profile();
+
+  void add(double t, unsigned long forms, unsigned long out, unsigned long most, const transduce_stats &s);
+};
+
+string json_string(const string &s);
+void report_profile(FILE *f, const change_profile *p, bool json);
+
+#endif
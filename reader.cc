@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "reader.h"
+
+word_reader::word_reader(int fd_) : fd(fd_), data(NULL), start(0), end(0), eof(false), fatal(true),
+                                    buf(NULL), cap(0), map(NULL), map_size(0) {
+  struct stat st;
+  off_t at = lseek(fd, 0, SEEK_CUR);
+  if (at >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > at) {
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m != MAP_FAILED) {
+      madvise(m, st.st_size, MADV_SEQUENTIAL);
+      data = map = (const char *)m;
+      map_size = st.st_size;
+      start = at;
+      end = map_size;
+      eof = true;
+      return;
+    }
+  }
+
+  cap = 1 << 16;
+  data = buf = (char *)malloc(cap);
+}
+
+word_reader::~word_reader() {
+  if (map)
+    munmap((void *)map, map_size);
+  free(buf);
+}
+
+/* Read another block, after moving what's left to the front.  */
+void word_reader::fill() {
+  memmove(buf, buf + start, end - start);
+  end -= start;
+  start = 0;
+  if (end == cap) {
+    cap *= 2;
+    data = buf = (char *)realloc(buf, cap);
+  }
+
+  ssize_t k;
+  while ((k = read(fd, buf + end, cap - end)) < 0 && errno == EINTR);
+  if (k < 0 && fatal) {
+    fprintf(stderr, "couldn't read input: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (k <= 0)
+    eof = true;
+  else
+    end += k;
+}
+
+/* A last line without a newline still counts.  */
+bool word_reader::next(const char **p, size_t *n) {
+  while (1) {
+    const char *nl = (const char *)memchr(data + start, '\n', end - start);
+    if (nl) {
+      *p = data + start;
+      *n = nl - *p;
+      start += *n + 1;
+      return true;
+    }
+    if (eof) {
+      if (start == end)
+        return false;
+      *p = data + start;
+      *n = end - start;
+      start = end;
+      return true;
+    }
+    fill();
+  }
+}
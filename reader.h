@@ -0,0 +1,34 @@
+#ifndef __RSCA_READER
+#define __RSCA_READER
+
+#include <stddef.h>
+
+/* Input words a line at a time, without copying them anywhere.  If the
+   input is a plain file we map the whole of it (from wherever the file
+   offset has got to) and hand out pointers straight into the mapping;
+   otherwise (a pipe, a terminal) we read it in big blocks into a buffer
+   of our own, which only grows if a single line won't fit.  Either way
+   a line given by next() stays put until the next call, and doesn't
+   include its newline.  A read that fails is reported, and we exit,
+   since otherwise the run would just stop part way with nothing said;
+   unless fatal is cleared, when it's taken as the end.  */
+struct word_reader {
+  int fd;
+  const char *data; // the mapping or buf
+  size_t start, end; // the part of data not handed out yet
+  bool eof; // nothing more will arrive after end
+  bool fatal; // a failed read ends the program, rather than just the input
+
+  char *buf; // for reading
+  size_t cap;
+  const char *map; // for mapping
+  size_t map_size;
+
+  word_reader(int fd_);
+  ~word_reader();
+
+  bool next(const char **p, size_t *n);
+  void fill();
+};
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <set>
+
+#include "server.h"
+#include "automaton.h"
+#include "soundchange.h"
+#include "cache.h"
+#include "fuse.h"
+#include "memo.h"
+#include "reader.h"
+#include "writer.h"
+
+/* The server.  Each line of a request names one of the rule files we were
+   started with (just as it was given), says which way to go (">" for
+   forwards and "<" for reverse, as with -B), and then gives the words,
+   separated by blanks:
+
+     rules.txt > word word word
+     rules.txt < word
+
+   and back comes a line for each word just as -B would print it (or its
+   records, with -O tsv), any warnings as lines beginning "! ", and then
+   an empty line.  Requests on different connections are answered at the
+   same time, as long as they're for the same rules going the same way;
+   see enter().
+
+   Parsing can't happen here, since the parser keeps its state in globals
+   and gives up with exit() when it doesn't like something.  So a rule
+   file is compiled by a child process, which writes it to a cache file
+   (the usual one with -c, or a temporary one) for us to load.  Whenever
+   a request comes in we look at the file's modification time, and if
+   it's changed we compile it afresh; requests that had already started
+   finish with what they had, and if the new version doesn't compile we
+   carry on with the old one.  */
+
+/* from apply.cc */
+extern char *filename;
+extern bool reverse_changes;
+extern bool complaint;
+extern bool use_cache;
+extern bool fuse;
+extern int memo_megabytes;
+extern memo_table *memo;
+extern vector<char *> rule_files;
+extern FILE *yyin;
+extern int yyparse();
+extern vector<automaton *> changes;
+extern vector<change_parameters *> change_stuff;
+extern bool answer_words(const vector<string> &words, bool make_phones, string &reply);
+
+/* One rule file compiled one way: what the globals must be set to for
+   apply_word() to use it.  */
+struct rule_set {
+  char *file;
+  bool reverse;
+  struct stat seen; // the file, when we last tried to compile it
+  vector<automaton *> changes, built; // built is before fusing
+  vector<change_parameters *> change_stuff, built_stuff;
+  int modtype[256];
+  map<string, int> wide_modtype;
+  memo_table *memo;
+  int users; // requests holding on to it
+  bool dead; // replaced by a newer version, so goes once users gets to 0
+};
+
+static bool quiet; // -q
+static map<pair<string, bool>, rule_set *> sets;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t loading = PTHREAD_MUTEX_INITIALIZER; // one compile at a time
+static pthread_cond_t turn = PTHREAD_COND_INITIALIZER;
+static rule_set *current = NULL; // whose changes are in the globals
+static int running = 0; // how many requests are using them, or -1 for one alone
+static unsigned tickets = 0, head = 0; // the queue for enter(): the next ticket, and the first waiting
+
+/* Put r's changes in the globals.  */
+static void install(rule_set *r) {
+  changes = r->changes;
+  change_stuff = r->change_stuff;
+  memcpy(modtype, r->modtype, sizeof(modtype));
+  wide_modtype = r->wide_modtype;
+  memo = r->memo;
+  filename = r->file;
+  reverse_changes = r->reverse;
+  complaint = !quiet && !r->reverse;
+  current = r;
+}
+
+/* Wait for r's changes to be in the globals, and for our turn to use
+   them.  Any number of requests can use the same changes together, but
+   putting in others has to wait until they're all done.  alone is for
+   anything that changes what the others are reading (new phones, or new
+   changes), and waits until nothing else is going on at all; r may be
+   NULL then, if it doesn't matter whose changes are in.
+   Callers are let in strictly in the order they came, by ticket, so a
+   steady stream of requests for the changes already in can't keep out
+   one for other changes, or a reload, for ever: once that's first in
+   the queue, nobody behind it gets in until it has.  */
+static void enter(rule_set *r, bool alone) {
+  pthread_mutex_lock(&lock);
+  unsigned t = tickets++;
+  while (t != head || running < 0 || (running > 0 && (alone || current != r)))
+    pthread_cond_wait(&turn, &lock);
+  head++;
+  running = alone ? -1 : running + 1;
+  if (r && current != r)
+    install(r);
+  pthread_cond_broadcast(&turn); // the next in line may be able to join us
+  pthread_mutex_unlock(&lock);
+}
+
+static void leave() {
+  pthread_mutex_lock(&lock);
+  running = running < 0 ? 0 : running - 1;
+  if (running == 0)
+    pthread_cond_broadcast(&turn);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Called with lock held, and nobody using r.  */
+static void destroy(rule_set *r) {
+  set<automaton *> a(r->changes.begin(), r->changes.end());
+  a.insert(r->built.begin(), r->built.end());
+  for(set<automaton *>::iterator ii=a.begin(); ii!=a.end(); ++ii)
+    delete *ii;
+  set<change_parameters *> p(r->change_stuff.begin(), r->change_stuff.end());
+  p.insert(r->built_stuff.begin(), r->built_stuff.end());
+  for(set<change_parameters *>::iterator ii=p.begin(); ii!=p.end(); ++ii)
+    delete *ii;
+  delete r->memo;
+  free(r->file);
+  if (current == r)
+    current = NULL;
+  delete r;
+}
+
+static void release(rule_set *r) {
+  pthread_mutex_lock(&lock);
+  if (--r->users == 0 && r->dead)
+    destroy(r);
+  pthread_mutex_unlock(&lock);
+}
+
+
+
+/* Compiling.  */
+
+/* Have a child parse file and save what it makes of it in cfile.  The
+   child starts off with our phone table, so that the cache it writes
+   will agree with ours; we make sure nobody's adding to it as we fork.  */
+static bool build(const char *file, bool reverse, const char *cfile, uint64_t key) {
+  enter(NULL, true);
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(2, 1); // the parser's chatter mustn't get into any answers
+    changes.clear();
+    change_stuff.clear();
+    memset(modtype, 0, sizeof(modtype));
+    wide_modtype.clear();
+    filename = strdup(file);
+    reverse_changes = reverse;
+    complaint = !quiet && !reverse;
+    if (NULL == (yyin = fopen(filename, "r")))
+      _exit(1);
+    _exit(yyparse() == 0 && save_cache(cfile, key, reverse) ? 0 : 1);
+  }
+  leave();
+
+  int status;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Load what build() made.  This can fail if new phones have turned up
+   since the child was forked, since its phone table won't match.  */
+static rule_set *take(const char *file, bool reverse, const char *cfile, uint64_t key) {
+  rule_set *r = NULL;
+  enter(NULL, true);
+  if (load_cache(cfile, key, reverse)) {
+    r = new rule_set();
+    r->file = strdup(file);
+    r->reverse = reverse;
+    r->built = changes;
+    r->built_stuff = change_stuff;
+    if (fuse)
+      fuse_changes(!quiet && !reverse);
+    r->changes = changes;
+    r->change_stuff = change_stuff;
+    memcpy(r->modtype, modtype, sizeof(modtype));
+    r->wide_modtype = wide_modtype;
+    r->memo = memo_megabytes ? new memo_table((size_t)memo_megabytes << 20) : NULL;
+    r->users = 0;
+    r->dead = false;
+    install(r);
+  }
+  leave();
+  return r;
+}
+
+static rule_set *compile(const char *file, bool reverse) {
+  bool hashed;
+  uint64_t key = hash_file(file, &hashed);
+  if (!hashed)
+    return NULL;
+
+  string cfile;
+  if (use_cache)
+    cfile = cache_name(file, reverse);
+  else {
+    char t[] = "/tmp/rsca-cache-XXXXXX";
+    int fd = mkstemp(t);
+    if (fd < 0)
+      return NULL;
+    close(fd);
+    cfile = t;
+  }
+
+  rule_set *r = use_cache ? take(file, reverse, cfile.c_str(), key) : NULL;
+  for(int tries=0; r == NULL && tries<3; tries++) {
+    if (!build(file, reverse, cfile.c_str(), key))
+      break;
+    r = take(file, reverse, cfile.c_str(), key);
+  }
+  if (!use_cache)
+    unlink(cfile.c_str());
+  return r;
+}
+
+static bool same_file(const struct stat &a, const struct stat &b) {
+  return a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+    a.st_size == b.st_size && a.st_ino == b.st_ino;
+}
+
+/* The rule set for file going the given way, compiled afresh if the file
+   has changed, and held on to until release().  NULL if it isn't one of
+   ours, or it's never compiled.  */
+static rule_set *find_rules(const string &file, bool reverse) {
+  if (find(rule_files.begin(), rule_files.end(), file) == rule_files.end())
+    return NULL;
+  pair<string, bool> k(file, reverse);
+  struct stat st;
+  bool gone = stat(file.c_str(), &st) != 0; // then carry on with what we have
+
+  for(int pass=0; pass<2; pass++) {
+    pthread_mutex_lock(&lock);
+    rule_set *r = sets.count(k) ? sets[k] : NULL;
+    if (r && (gone || same_file(r->seen, st))) {
+      r->users++;
+      pthread_mutex_unlock(&lock);
+      if (pass)
+        pthread_mutex_unlock(&loading);
+      return r;
+    }
+    pthread_mutex_unlock(&lock);
+    if (!pass) // someone else may be compiling it already, so look again once they're done
+      pthread_mutex_lock(&loading);
+  }
+
+  rule_set *n = gone ? NULL : compile(file.c_str(), reverse);
+  pthread_mutex_lock(&lock);
+  rule_set *r = sets.count(k) ? sets[k] : NULL;
+  if (n) {
+    n->seen = st;
+    if (r) {
+      r->dead = true;
+      if (r->users == 0)
+        destroy(r);
+    }
+    sets[k] = r = n;
+  }
+  else if (r) {
+    fprintf(stderr, "warning: couldn't compile \"%s\" again, so still using the old one\n", file.c_str());
+    r->seen = st;
+  }
+  if (r)
+    r->users++;
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&loading);
+  return r;
+}
+
+
+
+/* Requests.  */
+
+static void answer(const char *p, size_t n, string &reply) {
+  vector<string> f;
+  for(size_t i=0; i<n; ) {
+    for(; i < n && (p[i] == ' ' || p[i] == '\t'); i++);
+    size_t k = i;
+    for(; i < n && p[i] != ' ' && p[i] != '\t'; i++);
+    if (i > k)
+      f.push_back(string(p + k, i - k));
+  }
+  if (f.empty())
+    return; // nothing asked, so nothing said
+
+  if (f.size() < 2 || (f[1] != ">" && f[1] != "<")) {
+    reply += "! expected a rule file, > or <, and words\n\n";
+    return;
+  }
+  rule_set *r = find_rules(f[0], f[1] == "<");
+  if (r == NULL) {
+    reply += "! couldn't compile \"" + f[0] + "\"\n\n";
+    return;
+  }
+
+  vector<string> words(f.begin() + 2, f.end());
+  enter(r, false);
+  if (!answer_words(words, false, reply)) {
+    leave();
+    enter(r, true);
+    answer_words(words, true, reply);
+  }
+  leave();
+  release(r);
+  reply += "\n";
+}
+
+/* A connection that fails is no reason to stop serving the others, so
+   only stdin's read errors are fatal.  */
+static void converse(int in_fd, int out_fd, bool fatal) {
+  word_reader in(in_fd);
+  in.fatal = fatal;
+  word_writer out(out_fd);
+  const char *p;
+  size_t n;
+  while (!out.bad && in.next(&p, &n)) {
+    string reply;
+    answer(p, n, reply);
+    out.add(reply);
+    out.flush();
+  }
+}
+
+static void *connection(void *fd) {
+  int k = (int)(long)fd;
+  converse(k, k, false);
+  close(k);
+  return NULL;
+}
+
+/* Compile all the rule files forwards to begin with, so that mistakes in
+   them show up now; reverse ones are only compiled once they're asked
+   for, since they can take a lot longer.  Then answer requests until
+   we're killed, or stdin runs out.  */
+void serve(const char *where) {
+  signal(SIGPIPE, SIG_IGN); // a client going away is no reason to stop
+  quiet = !complaint;
+  for(int i=0; i<rule_files.size(); i++) {
+    rule_set *r = find_rules(rule_files[i], false);
+    if (r == NULL) {
+      fprintf(stderr, "couldn't compile \"%s\"\n", rule_files[i]);
+      exit(1);
+    }
+    release(r);
+  }
+
+  if (!strcmp(where, "-")) {
+    fflush(stdout);
+    converse(fileno(stdin), fileno(stdout), true);
+    return;
+  }
+
+  struct sockaddr_un a;
+  memset(&a, 0, sizeof(a));
+  a.sun_family = AF_UNIX;
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (strlen(where) >= sizeof(a.sun_path) || s < 0) {
+    fprintf(stderr, "couldn't make socket \"%s\"\n", where);
+    exit(1);
+  }
+  strcpy(a.sun_path, where);
+
+  /* An old socket (from a server that's gone) is in the way of bind(),
+     but anything else there was probably named by mistake.  */
+  struct stat st;
+  if (!lstat(where, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "\"%s\" is already there, and isn't a socket\n", where);
+      exit(1);
+    }
+    unlink(where);
+  }
+  if (bind(s, (struct sockaddr *)&a, sizeof(a)) || listen(s, 64)) {
+    fprintf(stderr, "couldn't listen on \"%s\"\n", where);
+    exit(1);
+  }
+
+  for(;;) {
+    int c = accept(s, NULL, NULL);
+    if (c < 0)
+      continue;
+    pthread_t t;
+    if (pthread_create(&t, NULL, connection, (void *)(long)c))
+      close(c);
+    else
+      pthread_detach(t);
+  }
+}
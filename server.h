@@ -0,0 +1,10 @@
+#ifndef __RSCA_SERVER
+#define __RSCA_SERVER
+
+/* A long-running rsca (-S), which keeps the rule files it was given
+   compiled and answers requests for them over a Unix socket, or on stdin
+   and stdout.  See server.cc for what the requests look like.  */
+
+void serve(const char *where);
+
+#endif
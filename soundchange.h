@@ -1,16 +1,21 @@
 #ifndef __RSCA_SOUNDCHANGE
 #define __RSCA_SOUNDCHANGE
 
+#include <time.h>
 #include <string>
 
 using namespace std;
 
+struct automaton;
+
 struct change_parameters {
   string name;
   int max_epen;
   bool not_sporadic;
   bool respecting_conflicts;
   bool reflect;
+  double build_time; // seconds spent determinising and compiling
+  automaton *opposite; // with -R or -V, the change in the other direction
   
   change_parameters() {
     name = "";
@@ -18,7 +23,16 @@ struct change_parameters {
     not_sporadic = true;
     respecting_conflicts = true;
     reflect = false;
+    build_time = 0;
+    opposite = NULL;
   }
 };
 
+/* Seconds since some fixed point, for timing things.  */
+static inline double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
 #endif
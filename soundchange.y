@@ -12,6 +12,7 @@
 
   #include "soundchange.h"
   #include "automaton.h"
+  #include "pool.h"
   
   extern int yylex();
   extern char *yytext;
@@ -20,6 +21,21 @@
   extern char *filename;
   extern bool debug_automata;
   extern bool reverse_changes;
+  extern int jobs;
+  extern bool lazy_changes;
+  extern char *allowed_file;
+  extern bool round_trip;
+
+  /* A change that's been parsed and split, but not yet made into the
+     automaton that carries it out; see build_changes().  */
+  struct pending_change {
+    automaton *a; // as split
+    change_parameters *p;
+    int sort; // current_automaton_sort, when it was parsed
+    int line; // for error messages
+    automaton *b; // what it's built into
+    const char *error; // or why it couldn't be
+  };
   
   int yyparse();
   void yyerror(char *s);
@@ -31,11 +47,14 @@
                    int &i, int &j, int ii, int jj);
   automaton *split(automaton *a);
   void reachable_excluding(automaton *a, set<int> *s, int x, int y, int z);
-  vector<string> *corresponding_phoneset(vector<string> *v, string s0, string s1, int group);
+  vector<int> *corresponding_phoneset(vector<int> *v, string s0, string s1, int group);
+  void build_change(pending_change *c);
+  void build_changes();
 
   vector<automaton *> changes;
   vector<change_parameters *> change_stuff;
-  map<string, vector<string>*> category;
+  vector<pending_change> pending;
+  map<string, vector<int>*> category;
   map<int, string> split_category;
   string current_name;
   int current_automaton_sort = -1; 
@@ -49,15 +68,15 @@
   char *str;
   automaton *autp;
   change_parameters *parp;
-  vector<string> *vbstrp;
+  vector<int> *vbstrp;
   vector<transition *> *rautp;
   vector<automaton *> *vautpp;
   vector<vector<transition *> *> *vrautpp;
 }
 
-%token <ch> WS CPHONE MOD01 MOD10 MOD02 MOD11 ENVSPACE RSPACE PARALLEL POSINT
+%token <ch> WS ENVSPACE RSPACE PARALLEL POSINT
 SPORADIC UNDELETE NAME IGNORE_CONFLICTS FLIP_CONFLICTS
-%token <str> CLASSDEF CLASSREF STRING
+%token <str> CPHONE MOD01 MOD10 MOD02 MOD11 CLASSDEF CLASSREF STRING
 
 %type <str> phone
 %type <autp> env_part nil_or_env soundchange_strand soundchange_strands
@@ -73,6 +92,8 @@ SPORADIC UNDELETE NAME IGNORE_CONFLICTS FLIP_CONFLICTS
 %%
 
 foo: category_list soundchange_list {
+          build_changes();
+
           /* Don't forget about this bit of code!  It's really quite important.  */
           if (reverse_changes) {
             reverse(changes.begin(), changes.end());
@@ -91,11 +112,11 @@ category_list:     /* nil */ { }
 ;
 
 phone_set: opt_ws            {
-          $$ = new vector<string>;
+          $$ = new vector<int>;
         }
         | opt_ws phone phone_set {
           $$ = $3;
-          $$->push_back(string($2));
+          $$->push_back(intern($2));
         }
 ;
 
@@ -107,40 +128,23 @@ soundchange_list: /* nil */  { }
 
 
 soundchange: parameter_list opt_ws soundchange_strands {
-          if ($1->reflect)
-            $3->reflect();
-          automaton *b = $3->determinise($1->not_sporadic, current_automaton_sort, $1->respecting_conflicts);
-          if (b == NULL) {
-            fprintf(stderr, "%s:%d: conflict in determinisation (sound change may have ambiguous cases)\n",
-                    filename, line);
-            exit(1);
-          }
+          pending_change c = {$3, $1, current_automaton_sort, line, NULL, NULL};
+          pending.push_back(c);
           current_automaton_sort = -1;
+
+          /* The automata are printed as they're made, so then each change
+             has to be built before the next is parsed.  */
           if (debug_automata) {
-            printf("after determinise\n");
-            b->display();
-          }
-        
-          if (reverse_changes) {
-            if (!b->invert()) {
-              fprintf(stderr, "%s:%d: change cannot be reversed\n",
-                      filename, line);
+            build_change(&pending.back());
+            if (pending.back().error) {
+              fprintf(stderr, "%s:%d: %s\n", filename, line, pending.back().error);
               exit(1);
             }
-            if (debug_automata) {
-              printf("after reversal\n");
-              b->display();
-            }
           }
-        
-          // to an automaton whose transitions aren't being used elsewhere, do this:
-          $3->free_transitions(); $3;
-          changes.push_back(b);  
 
           /* Prepare the parameters of this change.  */
           if($1->name == "")
             $1->name = current_name;
-          change_stuff.push_back($1);
 
           current_name = "";
         }
@@ -273,7 +277,7 @@ renv_part: /* nil */ {
         }
         | phone renv_part {
           $$ = $2;
-          $$->push_back(new cst_transition(string($1)));
+          $$->push_back(new cst_transition(intern($1)));
         }
         | CLASSREF renv_part {
           automaton *c = interpret_classref($1, 0); // 0 is the default split-group in before
@@ -290,7 +294,7 @@ drenv_part: /* nil */ {
         }
         | phone drenv_part {
           $$ = $2;
-          $$->push_back(new cst_transition(string($1)));
+          $$->push_back(new cst_transition(intern($1)));
         }
         | CLASSREF drenv_part {
           char *u0 = $1;
@@ -341,39 +345,35 @@ env_part: phone                                 { $$ = new automaton($1); }
         | '(' env_part ')'                      { $$ = $2; }
 ;
 
-phone: 	  CPHONE		{
-          char *a = (char *)malloc(2);
-          a[1] = '\0'; a[0] = $1; 
-          $$ = a;
-        }
+phone: 	  CPHONE		{ $$ = $1; }
         | phone MOD11 phone	{
-          char *a = (char *)malloc(2+strlen($1)+strlen($3));
+          char *a = (char *)malloc(1+strlen($1)+strlen($2)+strlen($3));
           strcpy(a, $1);
-          a[1+strlen(a)] = '\0'; a[strlen(a)] = $2;
+          strcat(a, $2);
           strcat(a, $3);
-          ($1); ($3);
+          ($1); ($2); ($3);
           $$ = a;
         }
         | phone MOD10		{
-          char *a = (char *)malloc(2+strlen($1));
+          char *a = (char *)malloc(1+strlen($1)+strlen($2));
           strcpy(a, $1);
-          a[1+strlen(a)] = '\0'; a[strlen(a)] = $2;
-          ($1);
+          strcat(a, $2);
+          ($1); ($2);
           $$ = a;
         }
         | MOD02 phone phone	{
-          char *a = (char *)malloc(2+strlen($2)+strlen($3));
-          a[0] = $1;
-          strcpy(a+1, $2);
+          char *a = (char *)malloc(1+strlen($1)+strlen($2)+strlen($3));
+          strcpy(a, $1);
+          strcat(a, $2);
           strcat(a, $3);
-          ($2); ($3);
+          ($1); ($2); ($3);
           $$ = a;  
         }
         | MOD01 phone		{
-          char *a = (char *)malloc(2+strlen($2));
-          a[0] = $1;
-          strcpy(a+1, $2);
-          ($2);
+          char *a = (char *)malloc(1+strlen($1)+strlen($2));
+          strcpy(a, $1);
+          strcat(a, $2);
+          ($1); ($2);
           $$ = a;
         }
 /*        | phone phone MOD20	{
@@ -401,6 +401,94 @@ opt_ws:   /* nil */
 
 
 
+/* Determinise a change, reverse it if need be, and compile it.  Errors
+   are left in c for the caller to report.  With -R or -V it's compiled
+   in the other direction as well, which goes in c->p->opposite.  With -L
+   the determinising is only started, unless the change has to be
+   reversed (which needs all of it) or printed.  */
+void build_change(pending_change *c) {
+  double t0 = now();
+  if (c->p->reflect)
+    c->a->reflect();
+  bool both = allowed_file || round_trip;
+  if (lazy_changes && !reverse_changes && !both && !debug_automata) {
+    c->b = c->a->determinise_lazily(c->p->not_sporadic, c->sort, c->p->respecting_conflicts);
+    if (c->b == NULL)
+      c->error = "conflict in determinisation (sound change may have ambiguous cases)";
+    c->p->build_time = now() - t0;
+    return;
+  }
+  automaton *b = c->a->determinise(c->p->not_sporadic, c->sort, c->p->respecting_conflicts);
+  if (b == NULL) {
+    c->error = "conflict in determinisation (sound change may have ambiguous cases)";
+    return;
+  }
+  if (debug_automata) {
+    printf("after determinise\n");
+    b->display();
+  }
+
+  automaton *o = NULL;
+  if (reverse_changes || both) {
+    if (both) {
+      b->compile();
+      o = new automaton(0);
+      o->f = b->f;
+      o->q0 = b->q0;
+      o->minimise();
+    }
+    if (!b->invert()) {
+      c->error = "change cannot be reversed";
+      return;
+    }
+    if (debug_automata) {
+      printf("after reversal\n");
+      b->display();
+    }
+  }
+
+  b->compile();
+  int states = b->f.accept.size(), transitions = b->f.t.size();
+  b->minimise();
+  c->p->build_time = now() - t0;
+  if (debug_automata)
+    printf("minimised from %d states and %d transitions to %d and %d\n",
+           states, transitions, (int)b->f.accept.size(), (int)b->f.t.size());
+  if (o && !reverse_changes)
+    swap(b, o);
+  c->p->opposite = o;
+
+  // to an automaton whose transitions aren't being used elsewhere, do this:
+  c->a->free_transitions();
+  c->b = b;
+}
+
+static void build_change_job(int i, void *v) {
+  pending_change &c = (*(vector<pending_change> *)v)[i];
+  if (c.b == NULL && c.error == NULL)
+    build_change(&c);
+}
+
+/* Building the changes is most of the work of reading a rule file, and
+   each one's independent of the others, so once the whole file has been
+   parsed they're built -j at a time.  (Not during parsing, since interning
+   new phones reorders them under anything being built.)  The first change
+   in the file that couldn't be built is complained about, as if they'd
+   been built in order.  */
+void build_changes() {
+  worker_pool pool(jobs);
+  pool.run(pending.size(), build_change_job, &pending);
+  for(int i=0; i<pending.size(); i++) {
+    if (pending[i].error) {
+      fprintf(stderr, "%s:%d: %s\n", filename, pending[i].line, pending[i].error);
+      exit(1);
+    }
+    changes.push_back(pending[i].b);
+    change_stuff.push_back(pending[i].p);
+  }
+  pending.clear();
+}
+
 /* Tolerating these errors: we can try, if we set up some exceptionish mechanism.  */
 void yyerror (char *s) {
   fprintf(stderr, "%s:%d: %s at or before ", filename, line, s);
@@ -421,7 +509,7 @@ void yyerror (char *s) {
 void check_category(string s) {
   if (category.find(s) == category.end()) {
     if (s[0] == '^') {
-      vector<string> *v = new vector<string>(1, s.substr(1));
+      vector<int> *v = new vector<int>(1, intern(s.substr(1)));
       category[s] = v;
     }
     else {
@@ -462,12 +550,12 @@ void add_presentable_name(char *s) {
    The category names can be preceded by a ^, which complements them. */
 automaton *interpret_classref(char *p, int group) {
   /* s contains the phones matched or not matched, according to the value of s_pos. */
-  forfc<string> s("#", false);
+  forfc<int> s(BOUND_PH, false);
   bool first = true;
   
   char *q = strdup(p), *q0 = q, *q1;
   while(q1 = strsep(&q0, " \t")) {
-    forfc<string> t;
+    forfc<int> t;
     if (!*q1) continue;
     /* Handle split-group definitions.  */
     if (strspn(q1, "0123456789") == strlen(q1)) {
@@ -489,11 +577,11 @@ automaton *interpret_classref(char *p, int group) {
     }
     else if (*q1 == '^') {
       check_category(string(q1+1));
-      t = forfc<string>(*category[string(q1+1)], false); 
+      t = forfc<int>(*category[string(q1+1)], false); 
     }
     else {
       check_category(string(q1));
-      t = forfc<string>(*category[string(q1)], true);
+      t = forfc<int>(*category[string(q1)], true);
     }
 
     /* Remember the first category name for this split group, to use
@@ -508,7 +596,8 @@ automaton *interpret_classref(char *p, int group) {
   }
 
   (q);
-  return new automaton(&s.s, s.pos, group);
+  vector<int> v = s.list();
+  return new automaton(&v, s.pos, group);
 }
 
 /* Stick together vectors of before and after transitions, of categories
@@ -545,8 +634,8 @@ automaton *glue(vector<transition *> *r, vector<transition *> *dr) {
              to interpret categories.  First check that the categories correspond.  */
           string s0 = split_category[group];
           string s1 = ((splitting_transition *)(*dr)[jj])->h;
-          vector<string> *v = &((cst_transition *)(*r)[ii])->x;
-          vector<string> *w = corresponding_phoneset(v, s0, s1, group);
+          vector<int> *v = &((cst_transition *)(*r)[ii])->x;
+          vector<int> *w = corresponding_phoneset(v, s0, s1, group);
 
           automaton *b = new automaton(v, w);
           a->catenate(b);
@@ -575,7 +664,7 @@ void glue1(vector<transition *> *r, vector<transition *> *dr, automaton *a,
     transition *t;
 
     if (i>ii && (*r)[i]->kind() == SPL_TR) {
-      string s1 = "0";
+      int s1 = ZERO_PH;
       if (j>jj && (*dr)[j]->kind() == CST_TR) {
         s1 = ((cst_transition *)(*dr)[j])->x[0];
         j--;
@@ -584,7 +673,7 @@ void glue1(vector<transition *> *r, vector<transition *> *dr, automaton *a,
       i--;
     }
     else if (i>ii && (*r)[i]->kind() == NEG_TR) { // always has a split-group
-      string s1 = "0";
+      int s1 = ZERO_PH;
       if (j>jj && (*dr)[j]->kind() == CST_TR) {
         s1 = ((cst_transition *)(*dr)[j])->x[0];
         j--;
@@ -594,18 +683,18 @@ void glue1(vector<transition *> *r, vector<transition *> *dr, automaton *a,
       i--;
     }
     else if (i>ii && (*r)[i]->kind() == CST_TR && (*r)[i]->sgd >= 0) {
-      string s1 = "0";
+      int s1 = ZERO_PH;
       if (j>jj && (*dr)[j]->kind() == CST_TR) {
         s1 = ((cst_transition *)(*dr)[j])->x[0];
         j--;
       }
       t = new pos_transition(((cst_transition *)(*r)[i])->x,
-                             vector<string>(((cst_transition *)(*r)[i])->x.size(), s1));
+                             vector<int>(((cst_transition *)(*r)[i])->x.size(), s1));
       t->sgd = (*r)[i]->sgd;
       i--;
     }
     else if (j>jj && (*dr)[j]->kind() == SPL_TR)  {
-      string s0 = "0";
+      int s0 = ZERO_PH;
       if (i>ii && (*r)[i]->kind() == CST_TR) {
         s0 = ((cst_transition *)(*r)[i])->x[0];
         i--;
@@ -614,7 +703,7 @@ void glue1(vector<transition *> *r, vector<transition *> *dr, automaton *a,
       j--;
     }
     else {
-      string s0 = "0", s1 = "0";
+      int s0 = ZERO_PH, s1 = ZERO_PH;
       if (i>ii && (*r)[i]->kind() == CST_TR) {
         s0 = ((cst_transition *)(*r)[i])->x[0];
         i--;
@@ -635,8 +724,8 @@ void glue1(vector<transition *> *r, vector<transition *> *dr, automaton *a,
 /* Given a list of phones v and category names s0 and s1, return the list in which
    each of the phones in v is mapped to that phone in s1 corresponding to
    v in s0.  The group number is used only for error reporting.  */
-vector<string> *corresponding_phoneset(vector<string> *v, string s0, string s1, int group) {
-  vector<string> *w;
+vector<int> *corresponding_phoneset(vector<int> *v, string s0, string s1, int group) {
+  vector<int> *w;
   
   if (s0[0] == '\0') {
     fprintf(stderr, "%s:%d: group %d has no category\n", filename, line, group);
@@ -659,7 +748,7 @@ vector<string> *corresponding_phoneset(vector<string> *v, string s0, string s1,
       exit(1);
     }
 
-    w = new vector<string>(v->size());
+    w = new vector<int>(v->size());
     for(int k = v->size()-1; k>=0; k--) {
       for(int l = category[s0]->size()-1; l>=0; l--)
         if((*category[s0])[l] == (*v)[k]) {
@@ -669,7 +758,7 @@ vector<string> *corresponding_phoneset(vector<string> *v, string s0, string s1,
     }
   }
   else
-    w = new vector<string>(*v);
+    w = new vector<int>(*v);
 
   return w;
 }
@@ -680,8 +769,8 @@ automaton *split(automaton *a) {
   vector<bool> ref_firsts;
   vector<set<int> *> splittends;
   vector<int> sizes;
-  vector<vector<string> *> ins;
-  vector<vector<string> *> outs;
+  vector<vector<int> *> ins;
+  vector<vector<int> *> outs;
   int n = a->q.size();
   
   /* Find all active split-groups, by looking for referencing transitions, i.e.
@@ -756,8 +845,8 @@ automaton *split(automaton *a) {
 
         string s0 = split_category[group];
         string s1 = ((splitting_transition *)a->q[i].t[j])->h;
-        vector<string> *v = new vector<string>(((cst_transition *)a->q[i1].t[j1])->x);
-        vector<string> *w = corresponding_phoneset(v, s0, s1, group);
+        vector<int> *v = new vector<int>(((cst_transition *)a->q[i1].t[j1])->x);
+        vector<int> *w = corresponding_phoneset(v, s0, s1, group);
         
         /* Having checked all the conditions above, we may do this.  */
         groups.push_back(group);
@@ -0,0 +1,31 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+static const size_t block_size = 1 << 20;
+
+word_writer::word_writer(int fd_) : fd(fd_), tty(isatty(fd_)), bad(false) {
+  buf.reserve(block_size + 4096);
+}
+
+word_writer::~word_writer() {
+  flush();
+}
+
+void word_writer::add(const string &s) {
+  buf += s;
+  if (buf.size() >= block_size)
+    flush();
+}
+
+void word_writer::flush() {
+  for(size_t k=0; k<buf.size() && !bad; ) {
+    ssize_t n = write(fd, buf.data() + k, buf.size() - k);
+    if (n > 0)
+      k += n;
+    else if (n == 0 || errno != EINTR)
+      bad = true;
+  }
+  buf.clear();
+}
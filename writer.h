@@ -0,0 +1,24 @@
+#ifndef __RSCA_WRITER
+#define __RSCA_WRITER
+
+#include <string>
+
+using namespace std;
+
+/* Output, gathered up and written a big block at a time rather than
+   word by word.  On a terminal each batch goes out as soon as it's
+   done, since someone is probably waiting for it.  */
+struct word_writer {
+  int fd;
+  bool tty;
+  bool bad; // a write failed, so don't bother any more
+  string buf;
+
+  word_writer(int fd_);
+  ~word_writer();
+
+  void add(const string &s);
+  void flush();
+};
+
+#endif